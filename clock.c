@@ -0,0 +1,449 @@
+// MIDI clock tracking for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "constants.h"
+#include "clock.h"
+#include "midi.h"
+
+// The beat tracker.
+//
+// MIDI clock ticks reach us in USB packets, so they arrive in bursts and
+// the raw tick count jitters by up to a USB frame or two. Rather than
+// displaying the raw count we timestamp every tick against the free running
+// Timer1 and keep two smoothed estimates:
+//
+//   period    - the time between ticks, an exponential moving average of
+//               the measured intervals, kept in 8.8 fixed point timer counts.
+//   position  - where we are in the bar, in 1/256ths of a tick. Between
+//               ticks the position is extrapolated from the period, and each
+//               new tick pulls it a quarter of the way back to the raw count,
+//               which is enough to track tempo changes without showing the
+//               jitter.
+//
+// The extrapolation never runs more than one tick ahead of the last tick
+// received, so the position can't run away. After two missing ticks we
+// give up, rewind to the start of the bar until the clock comes back, and
+// resync to the raw count on the next tick.
+
+// Constants -------------------------------------------------------------------
+
+// Bar positions are measured in 1/256ths of a MIDI clock tick.
+#define POSITION_PER_TICK 256
+#define POSITION_PER_BEAT (MIDI_CLOCK_TICKS_PER_BEAT * POSITION_PER_TICK)
+#define POSITION_PER_BAR  (MIDI_CLOCK_TICKS_PER_BAR * POSITION_PER_TICK)
+
+// Tick periods in timer counts for the fastest and slowest tempos we
+// track, 300bpm and 20bpm, and the default of 120bpm.
+#define PERIOD_MIN     (CLOCK_TIMER_HZ * 60 / (300 * MIDI_CLOCK_TICKS_PER_BEAT))
+#define PERIOD_MAX     (CLOCK_TIMER_HZ * 60 / (20 * MIDI_CLOCK_TICKS_PER_BEAT))
+#define PERIOD_DEFAULT (CLOCK_TIMER_HZ * 60 / (120 * MIDI_CLOCK_TICKS_PER_BEAT))
+
+// Tracker states.
+#define CLOCK_STOPPED  0   // No clock, or waiting for the first tick.
+#define CLOCK_SYNCING  1   // Had one tick, waiting for an interval.
+#define CLOCK_RUNNING  2   // Tracking a steady clock.
+
+// Tap tempo limits, in milliseconds between taps (300bpm and 20bpm). A
+// longer gap starts a new tap sequence, and holding the tap key for
+// TAP_HOLD_MS starts or stops the transport instead.
+#define TAP_INTERVAL_MIN 200
+#define TAP_INTERVAL_MAX 3000
+#define TAP_HOLD_MS      1000
+
+// Globals ---------------------------------------------------------------------
+
+uint8_t g_clock_master;   // Generate MIDI clock instead of following it.
+uint8_t g_clock_tap_key;  // Key (0..15) that taps the master tempo.
+
+static uint8_t  s_clock_state;   // One of the tracker states above.
+static uint8_t  s_tick_count;    // Raw ticks received this bar (0..95).
+static uint16_t s_tick_time;     // Timer count when the last tick arrived.
+static uint16_t s_anchor_pos;    // Estimated bar position at s_tick_time.
+static uint32_t s_period;        // Smoothed tick period (8.8 fixed point).
+
+// Millisecond system clock, kept by the Timer1 overflow interrupt. Each
+// overflow is 65536 counts, 262 whole milliseconds and 36 counts over,
+// and the spare counts are carried so the clock doesn't drift.
+static volatile uint16_t s_millis;        // Milliseconds at the last overflow.
+static volatile uint8_t  s_millis_counts; // Timer counts carried (0..249).
+
+// Master clock generator. The Timer1 compare interrupt fires once per tick
+// and sends the 0xF8 straight to the host, s_master_ticks counts the ticks
+// not yet passed on to our own beat tracker.
+static volatile uint32_t s_master_period; // Tick period (8.8 fixed point).
+static volatile uint8_t  s_master_ticks;  // Ticks sent but not yet tracked.
+static uint8_t  s_master_fraction;        // Fractional timer count carried.
+static bool     s_master_playing;         // Transport started?
+static uint16_t s_tap_time;               // clock_millis() of the last tap.
+static uint16_t s_tap_interval;           // Smoothed tap interval in ms.
+static bool     s_tap_sequence;           // Is s_tap_time a recent tap?
+
+// Functions -------------------------------------------------------------------
+
+// Start Timer1 free running, which gives us a 4us timebase for
+// timestamping events.
+//
+void clock_setup(void)
+{
+    // Normal mode, no output compare pins, prescaler clk/64. The overflow
+    // interrupt keeps the millisecond clock.
+    TCCR1A = 0;
+    TCCR1B = _BV(CS11) | _BV(CS10);
+    TIMSK1 |= _BV(TOIE1);
+
+    s_period = (uint32_t)PERIOD_DEFAULT << 8;
+    s_master_period = (uint32_t)PERIOD_DEFAULT << 8;
+    clock_midi_stop();
+}
+
+// Read the free running timer. The 16-bit read goes through a temporary
+// register shared with any interrupt that touches Timer1, so it has to be
+// done with interrupts off.
+//
+uint16_t clock_timer_now(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t now = TCNT1;
+    SREG = sreg;
+    return now;
+}
+
+// Timer1 has wrapped round, another 262.144ms have gone by.
+//
+ISR(TIMER1_OVF_vect)
+{
+    uint8_t counts = s_millis_counts + (uint8_t)(65536UL % CLOCK_TICKS_PER_MS);
+    uint16_t millis = s_millis + (uint16_t)(65536UL / CLOCK_TICKS_PER_MS);
+    if (counts >= CLOCK_TICKS_PER_MS) {
+        counts -= CLOCK_TICKS_PER_MS;
+        ++millis;
+    }
+    s_millis_counts = counts;
+    s_millis = millis;
+}
+
+// Return the number of milliseconds since power up. This runs from Timer1,
+// so it keeps going while the host is asleep and USB frames stop.
+// The count wraps every 65 seconds, so only use it to measure short
+// intervals.
+//
+uint16_t clock_millis(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t now = TCNT1;
+    uint16_t millis = s_millis;
+    uint16_t counts = s_millis_counts;
+    // An overflow that happened since interrupts went off hasn't been
+    // counted yet.
+    if ((TIFR1 & _BV(TOV1)) && now < 0x8000) {
+        millis += (uint16_t)(65536UL / CLOCK_TICKS_PER_MS);
+        counts += (uint16_t)(65536UL % CLOCK_TICKS_PER_MS);
+    }
+    SREG = sreg;
+    return millis + (uint16_t)(((uint32_t)now + counts) / CLOCK_TICKS_PER_MS);
+}
+
+// Master clock ----------------------------------------------------------------
+
+// Timer1 compare A fires once per MIDI clock tick while master mode is on.
+// The tick goes out through the MIDI Real Time lane so it leaves with
+// interrupt timing rather than waiting for the main loop, then the compare
+// register is moved on by one period. The fractional part of the period is
+// carried from tick to tick so the long term tempo is exact.
+//
+ISR(TIMER1_COMPA_vect)
+{
+    uint16_t step = (uint16_t)(s_master_period >> 8);
+    uint16_t fraction = s_master_fraction + (uint8_t)s_master_period;
+    if (fraction > 0xff) {
+        ++step;
+    }
+    s_master_fraction = (uint8_t)fraction;
+    OCR1A += step;
+
+    midi_send_realtime(0xF8);
+    ++s_master_ticks;
+}
+
+// Schedule the next master tick one period from now. Call with interrupts
+// off.
+//
+static void clock_master_schedule(void)
+{
+    OCR1A = TCNT1 + (uint16_t)(s_master_period >> 8);
+    s_master_fraction = 0;
+    TIFR1 = _BV(OCF1A);
+}
+
+// Called once per main loop pass. Starts and stops the tick generator to
+// follow g_clock_master and feeds our own ticks to the beat tracker so the
+// LEDs show the master tempo.
+//
+void clock_master_task(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    bool enabled = (TIMSK1 & _BV(OCIE1A)) != 0;
+    if (g_clock_master && !enabled) {
+        clock_master_schedule();
+        TIMSK1 |= _BV(OCIE1A);
+    } else if (!g_clock_master && enabled) {
+        TIMSK1 &= ~_BV(OCIE1A);
+    }
+    uint8_t ticks = s_master_ticks;
+    s_master_ticks = 0;
+    SREG = sreg;
+
+    if (!g_clock_master) {
+        if (s_master_playing) {
+            s_master_playing = false;
+            midi_send_realtime(0xFC);
+            clock_midi_stop();
+        }
+        return;
+    }
+    while (ticks--) {
+        clock_midi_tick();
+    }
+}
+
+// The tap key was pressed at clock_millis() "time", as timestamped by the
+// key scan interrupt. Each tap measures the interval since the one before,
+// the first interval of a sequence sets the tempo outright and later ones
+// are averaged in so a slightly uneven tap doesn't lurch.
+//
+void clock_tap_press(const uint16_t time)
+{
+    uint16_t interval = time - s_tap_time;
+    s_tap_time = time;
+
+    if (!s_tap_sequence || interval > TAP_INTERVAL_MAX) {
+        s_tap_sequence = true;
+        s_tap_interval = 0;
+        return;
+    }
+    if (interval < TAP_INTERVAL_MIN) return;
+
+    if (s_tap_interval == 0) {
+        s_tap_interval = interval;
+    } else {
+        s_tap_interval = (3 * s_tap_interval + interval) / 4;
+    }
+
+    // Milliseconds per beat to timer counts per tick, in 8.8 fixed point.
+    uint32_t period = ((uint32_t)s_tap_interval * CLOCK_TICKS_PER_MS *
+                       256) / MIDI_CLOCK_TICKS_PER_BEAT;
+    uint8_t sreg = SREG;
+    cli();
+    s_master_period = period;
+    SREG = sreg;
+}
+
+// The tap key was released at clock_millis() "time". A long hold starts or
+// stops the transport, and doesn't count as a tap.
+//
+void clock_tap_release(const uint16_t time)
+{
+    if ((uint16_t)(time - s_tap_time) < TAP_HOLD_MS) return;
+    s_tap_sequence = false;
+
+    if (s_master_playing) {
+        s_master_playing = false;
+        midi_send_realtime(0xFC);
+        clock_midi_stop();
+    } else {
+        // Restart the tick train so the first tick after the Start lands
+        // one full period later, as the receiver expects.
+        uint8_t sreg = SREG;
+        cli();
+        clock_master_schedule();
+        s_master_ticks = 0;
+        SREG = sreg;
+        s_master_playing = true;
+        midi_send_realtime(0xFA);
+        clock_midi_start();
+    }
+}
+
+// Beat tracker ----------------------------------------------------------------
+
+// Extrapolate the bar position from the last tick to the time "now".
+//
+static uint16_t clock_predict(const uint16_t now)
+{
+    uint16_t elapsed = now - s_tick_time;
+    uint32_t advance = ((uint32_t)elapsed << 8) / (uint16_t)(s_period >> 8);
+    if (advance > POSITION_PER_TICK) {
+        advance = POSITION_PER_TICK;
+    }
+    uint16_t position = s_anchor_pos + (uint16_t)advance;
+    if (position >= POSITION_PER_BAR) {
+        position -= POSITION_PER_BAR;
+    }
+    return position;
+}
+
+// A 0xF8 Timing Clock message has arrived.
+//
+void clock_midi_tick(void)
+{
+    uint16_t now = clock_timer_now();
+    uint16_t interval = now - s_tick_time;
+
+    // Advance the raw count, which is where the host says we are.
+    if (++s_tick_count >= MIDI_CLOCK_TICKS_PER_BAR) {
+        s_tick_count = 0;
+    }
+    uint16_t expected = s_tick_count * POSITION_PER_TICK;
+
+    if (s_clock_state == CLOCK_STOPPED) {
+        // First tick after a start, stop or stall. Jump straight to the
+        // raw count.
+        s_anchor_pos = expected;
+        s_clock_state = CLOCK_SYNCING;
+
+    } else {
+        // Update the period. The first interval seeds the average so we
+        // lock on to a new tempo quickly, after that each interval only
+        // moves the average by 1/16th of the difference. Short intervals
+        // from a burst of packets are kept, as they balance out the long
+        // interval that came before the burst.
+        if (interval <= PERIOD_MAX) {
+            if (s_clock_state == CLOCK_SYNCING) {
+                if (interval >= PERIOD_MIN) {
+                    s_period = (uint32_t)interval << 8;
+                }
+            } else {
+                int32_t error = (int32_t)((uint32_t)interval << 8) -
+                                (int32_t)s_period;
+                s_period = (uint32_t)((int32_t)s_period + error / 16);
+            }
+            if (s_period < ((uint32_t)PERIOD_MIN << 8)) {
+                s_period = (uint32_t)PERIOD_MIN << 8;
+            } else if (s_period > ((uint32_t)PERIOD_MAX << 8)) {
+                s_period = (uint32_t)PERIOD_MAX << 8;
+            }
+        }
+
+        // Update the phase, pulling our estimate towards the raw count.
+        // The error is wrapped so that the end of one bar and the start of
+        // the next are considered close together.
+        uint16_t predicted = clock_predict(now);
+        int16_t error = (int16_t)(expected - predicted);
+        if (error > POSITION_PER_BAR / 2) {
+            error -= POSITION_PER_BAR;
+        } else if (error < -(POSITION_PER_BAR / 2)) {
+            error += POSITION_PER_BAR;
+        }
+        if (error > 2 * POSITION_PER_TICK || error < -2 * POSITION_PER_TICK) {
+            // Too far out to be jitter, the host has jumped.
+            s_anchor_pos = expected;
+        } else {
+            int16_t position = (int16_t)predicted + error / 4;
+            if (position < 0) {
+                position += POSITION_PER_BAR;
+            } else if (position >= POSITION_PER_BAR) {
+                position -= POSITION_PER_BAR;
+            }
+            s_anchor_pos = (uint16_t)position;
+        }
+        s_clock_state = CLOCK_RUNNING;
+    }
+    s_tick_time = now;
+}
+
+// A 0xFA Start message has arrived. The next tick is the first tick of
+// the bar.
+//
+void clock_midi_start(void)
+{
+    s_clock_state = CLOCK_STOPPED;
+    s_tick_count = MIDI_CLOCK_TICKS_PER_BAR - 1;
+    s_anchor_pos = 0;
+}
+
+// A 0xFC Stop message has arrived. Rewind to the start of the bar.
+//
+void clock_midi_stop(void)
+{
+    clock_midi_start();
+}
+
+// Are we tracking a steady clock?
+//
+bool clock_running(void)
+{
+    return s_clock_state == CLOCK_RUNNING;
+}
+
+// Return the smoothed tempo in tenths of a BPM, or zero if there is no
+// clock running.
+//
+uint16_t clock_bpm(void)
+{
+    if (s_clock_state != CLOCK_RUNNING) return 0;
+    // 60 seconds * 10 / 24 ticks per beat = 25, and 256 for the fixed point.
+    return (uint16_t)(((uint32_t)CLOCK_TIMER_HZ * 25 * 256) / s_period);
+}
+
+// Return the smoothed position in the bar, in 1/256ths of a tick
+// (0..24575).
+//
+uint16_t clock_bar_position(void)
+{
+    if (s_clock_state != CLOCK_RUNNING) {
+        return s_anchor_pos;
+    }
+    uint16_t now = clock_timer_now();
+    // If two ticks have gone missing, the clock has stopped or stalled.
+    // Rewind to the start of the bar, as a Stop would, so blinking pads
+    // show as lit rather than stuck wherever the clock left off. The next
+    // tick resyncs to the raw count.
+    if ((uint32_t)(uint16_t)(now - s_tick_time) > (s_period >> 7)) {
+        s_clock_state = CLOCK_STOPPED;
+        s_anchor_pos = 0;
+        return s_anchor_pos;
+    }
+    return clock_predict(now);
+}
+
+// Return the smoothed position in the bar in whole ticks (0..95).
+//
+uint8_t clock_bar_tick(void)
+{
+    return (uint8_t)(clock_bar_position() >> 8);
+}
+
+// Return the smoothed position within the current beat (0..255).
+//
+uint8_t clock_beat_phase(void)
+{
+    return (uint8_t)((clock_bar_position() % POSITION_PER_BEAT) /
+                     MIDI_CLOCK_TICKS_PER_BEAT);
+}
+
+// -----------------------------------------------------------------------------
@@ -0,0 +1,63 @@
+// MIDI clock tracking for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+
+#ifndef _CLOCK_H_INCLUDED
+#define _CLOCK_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Constants -------------------------------------------------------------------
+
+// Timer1 free runs at F_CPU/64 = 250kHz, one count every 4 microseconds.
+#define CLOCK_TIMER_HZ (F_CPU / 64)
+#define CLOCK_TICKS_PER_MS (CLOCK_TIMER_HZ / 1000)
+
+// Globals ---------------------------------------------------------------------
+
+extern uint8_t g_clock_master;   // Generate MIDI clock (bool).
+extern uint8_t g_clock_tap_key;  // Key that taps the master tempo (0..15).
+
+// Clock functions -------------------------------------------------------------
+
+void clock_setup(void);
+uint16_t clock_timer_now(void);
+
+// 1ms system clock driven by Timer1.
+uint16_t clock_millis(void);
+
+// Master clock generated from tap tempo.
+void clock_master_task(void);
+void clock_tap_press(const uint16_t time);
+void clock_tap_release(const uint16_t time);
+
+// Incoming MIDI System Real Time messages.
+void clock_midi_tick(void);   // 0xF8
+void clock_midi_start(void);  // 0xFA
+void clock_midi_stop(void);   // 0xFC
+
+// Smoothed beat tracker.
+bool clock_running(void);
+uint16_t clock_bpm(void);
+uint16_t clock_bar_position(void);
+uint8_t clock_bar_tick(void);
+uint8_t clock_beat_phase(void);
+
+#endif // _CLOCK_H_INCLUDED
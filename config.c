@@ -2,6 +2,7 @@
 #include <util/delay.h>
 #include <string.h>
 #include <avr/wdt.h>
+#include <avr/pgmspace.h>
 
 #include "config.h"
 #include "sysex.h"
@@ -9,18 +10,15 @@
 
 // For the settings
 #include "led.h"
+#include "clock.h"
 #include "key.h"
 #include "midi.h"
 #include "eeprom.h"
 #include "expansion.h"
 #include "combo.h"
+#include "preset.h"
 #include "jumptoboot.h"
 
-// SysEx command constants
-#define SYSEX_COMMAND_PUSH_CONF 0x1
-#define SYSEX_COMMAND_PULL_CONF 0x2
-#define SYSEX_COMMAND_SYSTEM    0x3
-
 uint8_t g_auto_update = 0;
 
 // Command structure
@@ -37,79 +35,184 @@ typedef struct {
         uint8_t combos;             // 8
         uint8_t multiplexer;        // 9 Not supported by Pro
 		uint8_t rotate;             // 10
+        uint8_t meterCC;            // 11
+        uint8_t meterPosition;      // 12
+        uint8_t clockMaster;        // 13
+        uint8_t clockTapKey;        // 14
+        uint8_t blinkStates;        // 15
 } tvtable_t;
-#define TV_TABLE_SIZE 11
+#define TV_TABLE_SIZE 16
+
+// Tag/value pairs are decoded into a table in the SysEx scratch buffer as
+// they arrive, noting which tags were present, and applied once the whole
+// message is in. Tags that weren't sent, or were sent with a value out of
+// range, keep their current setting, and only the EEPROM cells that change
+// are rewritten, so the watchdog can stay running. The confirmation flash
+// runs over the next few LED updates rather than holding up the main loop.
+//
+typedef struct {
+    tvtable_t table;   // Values, indexed by tag.
+    uint16_t present;  // Bit per tag that was sent.
+    uint8_t tag;       // Tag waiting for its value.
+} PushConfig_t;
 
-void tv_table_decode(tvtable_t* table, uint8_t* buffer, uint8_t size)
+void sysExCmdPushConfig (uint8_t op, uint16_t index, uint8_t byte)
 {
-    uint8_t idx = 0;
-    uint8_t tag;
-    while (idx < size - 1) {
-        tag = buffer[idx++];
-        if (tag < TV_TABLE_SIZE) {
-            ((uint8_t*)table)[tag] = buffer[idx];
+    PushConfig_t* push = (PushConfig_t*)g_sysex_scratch;
+
+    if (op == SYSEX_BEGIN) {
+        push->present = 0;
+        return;
+    }
+    if (op == SYSEX_DATA) {
+        if (!(index & 1)) {
+            push->tag = byte;
+        } else if (push->tag < TV_TABLE_SIZE) {
+            ((uint8_t*)&push->table)[push->tag] = byte;
+            push->present |= 1 << push->tag;
         }
-        ++idx;
+        return;
     }
-}
-
-
-void sysExCmdPushConfig (SysEx_t* sysex, uint8_t* buffer)
-{
-	// First disable watch dog as EEPROM is slow to write to
-	wdt_disable();
-	
-    tvtable_t config;
-    tv_table_decode(&config, buffer, sysex->length-5);
+    if (op != SYSEX_END) return;
 
     // Change settings
-    g_midi_channel        = config.midiChannel - 1;
-    g_midi_velocity       = config.midiVelocity;
-    g_led_keypress_enable = config.keypressLeds;
-	g_key_fourbanks_mode  = config.fourBanksMode;
-    g_auto_update         = config.autoUpdate;
-    g_device_mode        = config.deviceMode;
-    g_combos_enable       = config.combos;
-	g_rotate_enable       = config.rotate;
+    for (uint8_t tag=0; tag<TV_TABLE_SIZE; ++tag) {
+        if (push->present & (1 << tag)) {
+            config_set_field(tag, ((uint8_t*)&push->table)[tag]);
+        }
+    }
 
     // Save to EEPROM
     eeprom_save_edits();
 
     // Flash LEDs to signal new configuration
-    uint16_t state = 0x000f;
-    for (uint8_t i=4; i; --i) {
-            led_set_state(state);
-            _delay_ms(75);
-            led_set_state(0x0000);
-            _delay_ms(75);
-            state <<= 4;
+    led_flash_start();
+}
+
+// Return the current value of a config setting by its tag.
+//
+uint8_t config_get_field (const uint8_t tag)
+{
+    switch (tag) {
+    case 0x00: return g_midi_channel + 1;     // midi channel
+    case 0x01: return g_midi_velocity;        // midi note velocity
+    case 0x02: return g_led_keypress_enable;  // led light on keypress
+    case 0x03: return g_key_fourbanks_mode;   // four banks mode disabled, enabled internal or enabled external
+    case 0x06: return g_auto_update;          // should the configuration tool keep this firmware up to date
+    case 0x07: return g_device_mode;          // Software Mode
+    case 0x08: return g_combos_enable;        // combos enabled or disabled
+    case 0x0A: return g_rotate_enable;
+    case 0x0B: return g_led_meter_cc;         // level meter CC
+    case 0x0C: return g_led_meter_position;   // level meter row/column
+    case 0x0D: return g_clock_master;         // generate MIDI clock
+    case 0x0E: return g_clock_tap_key;        // tap tempo key
+    case 0x0F: return g_led_blink_enable;     // velocities select blink states
+    }
+    return 0;
+}
+
+// Range of values each tag accepts, as sent over SysEx. Tags the Pro
+// doesn't support have an empty range.
+static const uint8_t kConfigRange[TV_TABLE_SIZE][2] PROGMEM = {
+    {1, 16},    // 0  midi channel
+    {1, 127},   // 1  midi note velocity
+    {0, 1},     // 2  led light on keypress
+    {0, 2},     // 3  four banks mode
+    {1, 0},     // 4  not supported by Pro
+    {1, 0},     // 5  not supported by Pro
+    {0, 1},     // 6  auto update
+    {0, 3},     // 7  software mode
+    {0, 1},     // 8  combos
+    {1, 0},     // 9  not supported by Pro
+    {0, 1},     // 10 rotate
+    {0, 127},   // 11 level meter CC
+    {0, 8},     // 12 level meter row/column
+    {0, 1},     // 13 generate MIDI clock
+    {0, 15},    // 14 tap tempo key
+    {0, 1},     // 15 blink states
+};
+
+// Does the Pro support this tag?
+//
+bool config_field_supported (const uint8_t tag)
+{
+    return tag < TV_TABLE_SIZE &&
+           pgm_read_byte(&kConfigRange[tag][0]) <=
+           pgm_read_byte(&kConfigRange[tag][1]);
+}
+
+// Is this a value the tag can be set to?
+//
+bool config_field_valid (const uint8_t tag, const uint8_t value)
+{
+    return config_field_supported(tag) &&
+           value >= pgm_read_byte(&kConfigRange[tag][0]) &&
+           value <= pgm_read_byte(&kConfigRange[tag][1]);
+}
+
+// Change a config setting by its tag, as push config would. Returns false,
+// changing nothing, for tags the Pro doesn't support and values out of
+// range.
+//
+bool config_set_field (const uint8_t tag, const uint8_t value)
+{
+    if (!config_field_valid(tag, value)) return false;
+    switch (tag) {
+    case 0x00: g_midi_channel = value - 1;         break;
+    case 0x01: g_midi_velocity = value;            break;
+    case 0x02: g_led_keypress_enable = value;      break;
+    case 0x03: g_key_fourbanks_mode = value;       break;
+    case 0x06: g_auto_update = value;              break;
+    case 0x07: g_device_mode = value;              break;
+    case 0x08: g_combos_enable = value;            break;
+    case 0x0A: g_rotate_enable = value;            break;
+    case 0x0B: g_led_meter_cc = value;             break;
+    case 0x0C: g_led_meter_position = value;       break;
+    case 0x0D: g_clock_master = value;             break;
+    case 0x0E: g_clock_tap_key = value;            break;
+    case 0x0F: g_led_blink_enable = value;         break;
     }
-	
-	// Enable watchdog again
-	wdt_enable(WDTO_120MS);
+    return true;
+}
+
+// The config reply is generated a byte at a time as it's sent, rather than
+// built up in a buffer on the stack.
+static const uint8_t kConfigHeader[] PROGMEM = {
+    0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+    SYSEX_COMMAND_PULL_CONF,
+    0x01, // 0x0 = request, 0x1 = response
+};
+static const uint8_t kConfigTags[] PROGMEM = {
+    0x00, 0x01, 0x02, 0x03, 0x06, 0x07, 0x08, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+    0x0F
+};
+#define CONFIG_DATA_LENGTH (sizeof(kConfigHeader) + 2 * sizeof(kConfigTags) + 1)
+
+static uint8_t config_data_byte (const uint16_t index, const void* context)
+{
+    if (index < sizeof(kConfigHeader)) {
+        return pgm_read_byte(&kConfigHeader[index]);
+    }
+    uint8_t offset = index - sizeof(kConfigHeader);
+    if (offset >= 2 * sizeof(kConfigTags)) {
+        return 0xf7;
+    }
+    uint8_t tag = pgm_read_byte(&kConfigTags[offset >> 1]);
+    if (offset & 1) {
+        return config_get_field(tag);
+    }
+    return tag;
 }
 
 void send_config_data (void)
 {
-    uint8_t payload[] = {0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
-                                SYSEX_COMMAND_PULL_CONF,
-                                0x01, // 0x0 = request, 0x1 = response
-                                0x00, g_midi_channel + 1,    // midi channel
-                                0x01, g_midi_velocity,       // midi note velocity
-                                0x02, g_led_keypress_enable, // led light on keypress
-                                0x03, g_key_fourbanks_mode,  // four banks mode disabled, enabled internal or enabled external
-                                0x06, g_auto_update,         // should the configuration tool keep this firmware up to date
-                                0x07, g_device_mode,         // Software Mode
-                                0x08, g_combos_enable,       // combos enabled or disabled
-								0x0A, g_rotate_enable,
-                                0xf7};
-    midi_stream_sysex(sizeof(payload), payload);
+    midi_stream_sysex_source(CONFIG_DATA_LENGTH, config_data_byte, 0);
 }
 
-void sysExCmdPullConfig (SysEx_t* sysex, uint8_t* command)
+void sysExCmdPullConfig (uint8_t op, uint16_t length, uint8_t byte)
 {
-    // Change settings
-    if (*command == 0x0) { // Received request
+    if (!sysex_collect(op, length, byte)) return;
+    if (length && g_sysex_scratch[0] == 0x0) { // Received request
         send_config_data();
     }
 }
@@ -117,9 +220,21 @@ void sysExCmdPullConfig (SysEx_t* sysex, uint8_t* command)
 void enter_bootloader_mode (void);
 void enter_menu_mode (void);
 void factory_reset (void);
+void send_state_snapshot (void);
+void select_preset (const uint8_t preset);
+
+void sysExCmdSnapshot (uint8_t op, uint16_t length, uint8_t byte)
+{
+    if (!sysex_collect(op, length, byte)) return;
+    if (length && g_sysex_scratch[0] == 0x0) { // Received request
+        send_state_snapshot();
+    }
+}
 
-void sysExCmdSystem (SysEx_t* sysex, uint8_t* command)
+void sysExCmdSystem (uint8_t op, uint16_t length, uint8_t byte)
 {
+    if (!sysex_collect(op, length, byte) || length == 0) return;
+    uint8_t* command = &g_sysex_scratch[0];
     if (*command == 0)
     {
         // Menu mode
@@ -132,6 +247,7 @@ void sysExCmdSystem (SysEx_t* sysex, uint8_t* command)
 		wdt_disable();
         //enter_bootloader_mode();
 		led_set_state(0xA5A5);
+		eeprom_flush();
 		Jump_To_Bootloader();
     } else if (*command == 2)
     {
@@ -142,6 +258,404 @@ void sysExCmdSystem (SysEx_t* sysex, uint8_t* command)
     }
 }
 
+// Set every LED in one message. The payload packs the 16 key LEDs and the
+// 4 expansion LEDs into three 7-bit bytes:
+//
+//   byte 0 - key LEDs 0..6
+//   byte 1 - key LEDs 7..13
+//   byte 2 - key LEDs 14..15 in bits 0..1, expansion LEDs 0..3 in bits 2..5
+//
+// optionally followed by 20 velocities, one per LED in the same order,
+// which select the blink state of each lit LED just like a NoteOn would.
+// Without them lit LEDs are on solid.
+//
+// The frame is written into the MIDI note state of the selected bank, so
+// it behaves exactly as if the equivalent NoteOns had arrived. Handlers run
+// from the MIDI receive loop before the LEDs are rebuilt, so the whole
+// frame is always shown at once.
+//
+static void led_frame_apply (const uint8_t* buffer, const uint8_t length)
+{
+    uint32_t frame = (uint32_t)buffer[0] |
+                     ((uint32_t)buffer[1] << 7) |
+                     ((uint32_t)buffer[2] << 14);
+    bool has_velocity = (length >= 3 + 20);
+
+    for (uint8_t i=0; i<20; ++i) {
+        uint8_t note;
+        if (i < 16) {
+            // In Fourbanks Internal mode the top row shows the bank.
+            if (g_key_fourbanks_mode == FOURBANKS_INTERNAL && i < 4) continue;
+            note = midi_fourbanks_key_to_note(i);
+        } else {
+            note = MIDI_DIGITAL_NOTE + (i - 16);
+        }
+        uint8_t velocity = 0;
+        if (frame & ((uint32_t)1 << i)) {
+            velocity = has_velocity ? buffer[3 + i] : 127;
+            if (velocity == 0) velocity = 127;
+        }
+        midi_note_set(note, velocity);
+    }
+}
+
+void sysExCmdLedFrame (uint8_t op, uint16_t length, uint8_t byte)
+{
+    if (!sysex_collect(op, length, byte) || length < 3) return;
+    if (length > SYSEX_SCRATCH_SIZE) {
+        length = SYSEX_SCRATCH_SIZE;
+    }
+    led_frame_apply(g_sysex_scratch, length);
+}
+
+// Read or write raw EEPROM. Addresses and lengths are sent as two 7-bit
+// bytes, low bits first, and the data itself is packed 8-to-7.
+//
+//   request  00 <addr> <length>          read "length" bytes
+//            01 <addr> <packed data>     write up to 8 bytes, below the
+//                                        journal and after the version
+//
+//   reply    01 <addr> <length> <packed data>
+//            02 <addr> <length>          bytes written
+//
+#define EEPROM_SIZE (E2END + 1)
+
+static uint8_t eeprom_byte (const uint16_t index, const void* context)
+{
+    return eeprom_read(*(const uint16_t*)context + index);
+}
+
+// Write data is staged in the SysEx scratch buffer along with the request
+// header and decoder state, and only written once the whole message has
+// arrived, so a message that is cut short writes nothing. A write is
+// limited to MEMORY_WRITE_MAX bytes, a longer one writes nothing.
+#define MEMORY_WRITE_MAX 8
+
+typedef struct {
+    uint8_t request[5];     // 00/01, address and (for reads) length.
+    SysExUnpack_t unpack;   // Decoder for write data.
+    uint8_t count;          // Bytes of write data staged.
+    bool overflow;          // Sent more than MEMORY_WRITE_MAX bytes?
+    uint8_t data[MEMORY_WRITE_MAX];
+} MemoryRequest_t;
+
+void sysExCmdMemory (uint8_t op, uint16_t index, uint8_t byte)
+{
+    MemoryRequest_t* req = (MemoryRequest_t*)g_sysex_scratch;
+
+    if (op == SYSEX_BEGIN) {
+        sysex_unpack_begin(&req->unpack);
+        req->count = 0;
+        req->overflow = false;
+        return;
+    }
+    if (op == SYSEX_DATA) {
+        if (index < sizeof(req->request)) {
+            req->request[index] = byte;
+            if (index < 3 || req->request[0] != 0x01) return;
+        }
+        if (req->request[0] != 0x01) return;
+        uint8_t data;
+        if (sysex_unpack_byte(&req->unpack, byte, &data)) {
+            if (req->count < MEMORY_WRITE_MAX) {
+                req->data[req->count++] = data;
+            } else {
+                req->overflow = true;
+            }
+        }
+        return;
+    }
+    if (op != SYSEX_END || index < 3) return;
+
+    uint16_t address = req->request[1] | (req->request[2] << 7);
+    if (address >= EEPROM_SIZE) return;
+
+    uint16_t count = 0;
+    if (req->request[0] == 0x00 && index >= 5) {
+        // Read, clamped to the end of the EEPROM.
+        count = req->request[3] | (req->request[4] << 7);
+        if (count > EEPROM_SIZE - address) {
+            count = EEPROM_SIZE - address;
+        }
+        uint8_t header[] = {0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+                            SYSEX_COMMAND_MEMORY, 0x01,
+                            address & 0x7f, address >> 7,
+                            count & 0x7f, count >> 7};
+        // Read as the reply goes out, after we've returned.
+        static uint16_t s_read_address;
+        if (midi_sysex_busy()) return;
+        s_read_address = address;
+        sysex_stream_packed(header, sizeof(header), count,
+                            eeprom_byte, &s_read_address);
+
+    } else if (req->request[0] == 0x01) {
+        // Write, all or nothing. Unchanged cells are left alone. The layout
+        // version and the runtime state journal are off limits, as is any
+        // value its cell can't hold. What's running is then brought in
+        // line with what was written: a write to the preset slots reloads
+        // the active slot, a write to the settings reloads them and copies
+        // them into the active slot, so the slot can't undo the write.
+        bool valid = !req->overflow && address >= EE_FIRST_BOOT_CHECK &&
+                     address + req->count <= EE_JOURNAL_START;
+        for (uint8_t i=0; valid && i<req->count; ++i) {
+            valid = eeprom_value_valid(address + i, req->data[i]);
+        }
+        if (valid) {
+            count = req->count;
+            for (uint8_t i=0; i<count; ++i) {
+                eeprom_update(address + i, req->data[i]);
+            }
+            if (address >= EE_PRESETS) {
+                preset_setup();
+            } else {
+                eeprom_load();
+                preset_store();
+            }
+        }
+        uint8_t reply[] = {0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+                           SYSEX_COMMAND_MEMORY, 0x02,
+                           address & 0x7f, address >> 7,
+                           count & 0x7f, count >> 7,
+                           0xf7};
+        midi_stream_sysex(sizeof(reply), reply);
+    }
+}
+
+// Report the outbound MIDI statistics, packed 8-to-7:
+//
+//   dropped (16)  deferred (16)  packets (16)  suppressed (16)
+//   last batch (8)  peak batch (8)  peak wait (8)  input deferred (16)
+//
+// 16-bit values are low byte first.
+//
+void sysExCmdStats (uint8_t op, uint16_t length, uint8_t byte)
+{
+    if (!sysex_collect(op, length, byte)) return;
+    if (length == 0 || g_sysex_scratch[0] != 0x0) return;
+    if (midi_sysex_busy()) return;
+    // Copied to the scratch buffer, as the reply is read after we've
+    // returned.
+    const uint8_t stats[13] = {
+        g_midi_tx_dropped & 0xff,    g_midi_tx_dropped >> 8,
+        g_midi_tx_deferred & 0xff,   g_midi_tx_deferred >> 8,
+        g_midi_tx_packets & 0xff,    g_midi_tx_packets >> 8,
+        g_midi_tx_suppressed & 0xff, g_midi_tx_suppressed >> 8,
+        g_midi_tx_last_batch,
+        g_midi_tx_peak_batch,
+        g_midi_tx_peak_wait,
+        g_midi_rx_deferred & 0xff,   g_midi_rx_deferred >> 8,
+    };
+    const uint8_t header[] = {0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+                              SYSEX_COMMAND_STATS, 0x01};
+    memcpy(g_sysex_scratch, stats, sizeof(stats));
+    sysex_stream_packed(header, sizeof(header), sizeof(stats),
+                        midi_source_ram, g_sysex_scratch);
+}
+
+// Describe what this firmware supports, so host tools can pick the best
+// way to talk to it without trial and error.
+//
+//   request  00
+//   reply    01 <protocol version> <command slots> <commands 0..6>
+//            <commands 7..13> <config tags> <scratch size> <input budget>
+//            <output queue size> <EEPROM size, two 7-bit bytes>
+//
+// The two command bytes have a bit set for each command that is
+// installed.
+//
+void sysExCmdCapabilities (uint8_t op, uint16_t length, uint8_t byte)
+{
+    if (!sysex_collect(op, length, byte)) return;
+    if (length == 0 || g_sysex_scratch[0] != 0x0) return;
+
+    uint16_t commands = sysex_command_mask();
+    uint8_t reply[] = {0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+                       SYSEX_COMMAND_CAPABILITIES, 0x01,
+                       SYSEX_PROTOCOL_VERSION,
+                       SYSEX_MAX_COMMANDS,
+                       commands & 0x7f, (commands >> 7) & 0x7f,
+                       TV_TABLE_SIZE,
+                       SYSEX_SCRATCH_SIZE,
+                       MIDI_INPUT_BUDGET,
+                       MIDI_QUEUE_SIZE,
+                       EEPROM_SIZE & 0x7f, EEPROM_SIZE >> 7,
+                       0xf7};
+    midi_stream_sysex(sizeof(reply), reply);
+}
+
+// Run a list of operations as one transaction, with one reply:
+//
+//   request  01 <tag> <value>    set a config field
+//            02 <b0> <b1> <b2>   show an LED frame, as command 4
+//            03 <tag>            query a config field
+//            ...
+//
+//   reply    01 <status> <tag> <value> ...
+//
+// Nothing is changed until the whole message has arrived and checked, so
+// an unknown operation, a tag the Pro doesn't support, a value out of
+// range or a message cut short leaves everything as it was and replies
+// with status 01. Otherwise the fields are set and
+// the changes saved, the frame is shown, status is 00 and each queried field is
+// reported with its new value, in tag order. Everything is staged in the
+// SysEx scratch buffer.
+//
+#define TRANSACTION_SET_FIELD  0x01
+#define TRANSACTION_LED_FRAME  0x02
+#define TRANSACTION_QUERY      0x03
+
+typedef struct {
+    uint8_t values[TV_TABLE_SIZE];  // Staged field values.
+    uint16_t set;                   // Bit per field in "values".
+    uint16_t query;                 // Bit per field to report.
+    uint8_t frame[3];               // Staged LED frame.
+    bool has_frame;
+    bool error;
+    uint8_t op;                     // Operation being read, 0 = none.
+    uint8_t arg;                    // Arguments read for "op".
+    uint8_t tag;                    // Tag argument of "op".
+} Transaction_t;
+
+static void transaction_data (Transaction_t* t, uint8_t byte)
+{
+    if (t->op == 0) {
+        if (byte < TRANSACTION_SET_FIELD || byte > TRANSACTION_QUERY) {
+            t->error = true;
+        }
+        t->op = byte;
+        t->arg = 0;
+        return;
+    }
+
+    uint8_t arg = t->arg++;
+    if (t->op == TRANSACTION_LED_FRAME) {
+        t->frame[arg] = byte;
+        if (arg == 2) {
+            t->has_frame = true;
+            t->op = 0;
+        }
+        return;
+    }
+
+    if (arg == 0) {
+        if (!config_field_supported(byte)) {
+            t->error = true;
+            return;
+        }
+        t->tag = byte;
+        if (t->op == TRANSACTION_QUERY) {
+            t->query |= 1 << byte;
+            t->op = 0;
+        }
+    } else {
+        if (!config_field_valid(t->tag, byte)) {
+            t->error = true;
+            return;
+        }
+        t->values[t->tag] = byte;
+        t->set |= 1 << t->tag;
+        t->op = 0;
+    }
+}
+
+static const uint8_t kTransactionHeader[] PROGMEM = {
+    0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+    SYSEX_COMMAND_TRANSACTION,
+    0x01, // reply
+};
+
+// Byte source for the reply: the header, the status, a tag/value pair for
+// each queried field and the closing 0xF7.
+static uint8_t transaction_reply_byte (const uint16_t index,
+                                       const void* context)
+{
+    const Transaction_t* t = (const Transaction_t*)context;
+    if (index < sizeof(kTransactionHeader)) {
+        return pgm_read_byte(&kTransactionHeader[index]);
+    }
+    uint8_t offset = index - sizeof(kTransactionHeader);
+    if (offset == 0) {
+        return t->error ? 0x01 : 0x00;
+    }
+    --offset;
+    uint8_t pair = offset >> 1;
+    for (uint8_t tag=0; tag<TV_TABLE_SIZE; ++tag) {
+        if ((t->query & (1 << tag)) && pair-- == 0) {
+            return (offset & 1) ? config_get_field(tag) : tag;
+        }
+    }
+    return 0xf7;
+}
+
+void sysExCmdTransaction (uint8_t op, uint16_t index, uint8_t byte)
+{
+    Transaction_t* t = (Transaction_t*)g_sysex_scratch;
+
+    if (op == SYSEX_BEGIN) {
+        memset(t, 0, sizeof(Transaction_t));
+        return;
+    }
+    if (op == SYSEX_DATA) {
+        if (!t->error) {
+            transaction_data(t, byte);
+        }
+        return;
+    }
+    if (op != SYSEX_END) return;
+
+    // An operation missing its arguments fails the lot.
+    if (t->op != 0) {
+        t->error = true;
+    }
+
+    uint8_t count = 0;
+    if (t->error) {
+        t->query = 0;
+    } else {
+        if (t->set) {
+            for (uint8_t tag=0; tag<TV_TABLE_SIZE; ++tag) {
+                if (t->set & (1 << tag)) {
+                    config_set_field(tag, t->values[tag]);
+                }
+            }
+            eeprom_save_edits();
+        }
+        if (t->has_frame) {
+            led_frame_apply(t->frame, sizeof(t->frame));
+        }
+        for (uint8_t tag=0; tag<TV_TABLE_SIZE; ++tag) {
+            if (t->query & (1 << tag)) {
+                ++count;
+            }
+        }
+    }
+    // The reply is generated from the request as it's sent. SysEx input is
+    // held back until it has gone, so nothing else touches the scratch
+    // buffer in the meantime.
+    midi_stream_sysex_source(sizeof(kTransactionHeader) + 1 + 2 * count + 1,
+                             transaction_reply_byte, t);
+}
+
+// Report or switch the active preset slot:
+//
+//   request  00        query
+//            01 <n>    switch to preset n (0..3)
+//   reply    01 <active preset> <preset count>
+//
+void sysExCmdPreset (uint8_t op, uint16_t length, uint8_t byte)
+{
+    if (!sysex_collect(op, length, byte) || length == 0) return;
+    if (g_sysex_scratch[0] == 0x1 && length >= 2) {
+        select_preset(g_sysex_scratch[1]);
+    } else if (g_sysex_scratch[0] != 0x0) {
+        return;
+    }
+    uint8_t reply[] = {0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+                       SYSEX_COMMAND_PRESET, 0x01,
+                       g_preset_active, PRESET_COUNT,
+                       0xf7};
+    midi_stream_sysex(sizeof(reply), reply);
+}
 
 void config_setup (void)
 {
@@ -149,4 +663,11 @@ void config_setup (void)
     sysex_install(SYSEX_COMMAND_PUSH_CONF, sysExCmdPushConfig);
     sysex_install(SYSEX_COMMAND_PULL_CONF, sysExCmdPullConfig);
     sysex_install(SYSEX_COMMAND_SYSTEM,    sysExCmdSystem);
+    sysex_install(SYSEX_COMMAND_LED_FRAME, sysExCmdLedFrame);
+    sysex_install(SYSEX_COMMAND_MEMORY,    sysExCmdMemory);
+    sysex_install(SYSEX_COMMAND_STATS,     sysExCmdStats);
+    sysex_install(SYSEX_COMMAND_SNAPSHOT,  sysExCmdSnapshot);
+    sysex_install(SYSEX_COMMAND_CAPABILITIES, sysExCmdCapabilities);
+    sysex_install(SYSEX_COMMAND_TRANSACTION, sysExCmdTransaction);
+    sysex_install(SYSEX_COMMAND_PRESET,      sysExCmdPreset);
 }
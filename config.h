@@ -23,11 +23,31 @@
 #ifndef _CONFIG_H_INCLUDED
 #define _CONFIG_H_INCLUDED
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// SysEx command constants ---------------------------------------
+
+#define SYSEX_COMMAND_PUSH_CONF 0x1
+#define SYSEX_COMMAND_PULL_CONF 0x2
+#define SYSEX_COMMAND_SYSTEM    0x3
+#define SYSEX_COMMAND_LED_FRAME 0x4
+#define SYSEX_COMMAND_MEMORY    0x5
+#define SYSEX_COMMAND_STATS     0x6
+#define SYSEX_COMMAND_SNAPSHOT  0x7
+#define SYSEX_COMMAND_CAPABILITIES 0x8
+#define SYSEX_COMMAND_TRANSACTION  0x9
+#define SYSEX_COMMAND_PRESET       0xA
+
 // SysEx functions -----------------------------------------------
 
 void config_setup (void);
 
 void send_config_data (void);
+uint8_t config_get_field (const uint8_t tag);
+bool config_set_field (const uint8_t tag, const uint8_t value);
+bool config_field_supported (const uint8_t tag);
+bool config_field_valid (const uint8_t tag, const uint8_t value);
 extern uint8_t g_auto_update;
 
 #endif // _SYSEX_H_INCLUDED
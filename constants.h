@@ -72,8 +72,9 @@
 // Should be the date of this firmware release, in hex, in the following format: 0xYYYYMMDD
 #define DEVICE_VERSION  0x20120816
 
-#define EEPROM_VERSION  6  // Increment this when the eeprom layout requires
-                           // resetting to the factory default.
+#define EEPROM_VERSION 10  // Increment this when the eeprom layout changes,
+                           // and add the migration step to eeprom.c.
+#define EEPROM_OLDEST_VERSION  6  // Oldest layout that can be migrated.
 
 // EEPROM memory locations of persistent settings
 #define EE_EEPROM_VERSION      0x0000  // Is the EEPROM layout current?
@@ -89,6 +90,18 @@
 #define EE_COMBOS_ENABLE       0x000a  // Combos enabled (1-bit)
 #define EE_MULTIPLEXER_ENABLE  0x000b  // Multiplexer connected to A1 and D1,D2,D3 (1-bit)
 #define EE_ROTATE_ENABLE       0x000c  // Enables device rotation 
+#define EE_LED_METER_CC        0x000d  // CC driving the level meter (0..127)
+#define EE_LED_METER_POSITION  0x000e  // Level meter row/column (0..8)
+#define EE_CLOCK_MASTER        0x000f  // Generate MIDI clock (1-bit)
+#define EE_CLOCK_TAP_KEY       0x0010  // Key that taps the tempo (0..15)
+#define EE_LED_BLINK_ENABLE    0x0011  // Velocities select blink states (1-bit)
+
+// Preset slots, see preset.c. PRESET_COUNT slots of PRESET_FIELDS bytes.
+#define EE_PRESETS             0x0020
+
+// Runtime state journal, see eeprom.c. Kept clear of the settings above.
+#define EE_JOURNAL_START       0x0100
+#define EE_JOURNAL_END         0x0200
 
 // SysEx MIDI message manufacturer ID
 #define MANUFACTURER_ID 0x0179
@@ -107,7 +120,32 @@
 // Number of MIDI notes tracked
 #define MIDI_MAX_NOTES 128
 
+// Number of USB-MIDI events that can be waiting to go to the host. 8
+// events of 4 bytes fill one 32 byte bank of the IN endpoint, which is
+// more than the keys can generate in the 1ms between USB frames.
+#define MIDI_QUEUE_SIZE 8
+
+// Most USB-MIDI event packets read from the host on each pass of the main
+// loop. Anything more waits for the next pass, so a flood of LED updates
+// can't hold up the key scan.
+#define MIDI_INPUT_BUDGET 8
+
+// How long the SysEx writer will wait for the host to make room in the
+// queue before giving up on the message, in milliseconds. Nothing waits on
+// the writer, so this can be generous.
+#define MIDI_SYSEX_TIMEOUT_MS 250
+
+// First of the CCs sent by the analog controls, two per control.
+#define MIDI_ANALOG_CC 16
+
 // Note number of the basenote for the keys
 #define MIDI_BASE_NOTE 36
 
+// Note number of the first of the four expansion port digital keys.
+#define MIDI_DIGITAL_NOTE 4
+
+// MIDI clock runs at 24 ticks per beat, and we count four beats to the bar.
+#define MIDI_CLOCK_TICKS_PER_BEAT 24
+#define MIDI_CLOCK_TICKS_PER_BAR  96
+
 #endif // _CONSTANTS_H_INCLUDED
@@ -20,12 +20,16 @@
 //
 // rjgreen 2009-05-22
 
+#include <string.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 #include "led.h"
+#include "clock.h"
 #include "key.h"
 #include "midi.h"
+#include "preset.h"
 #include "eeprom.h"
 #include "selftest.h"
 #include "expansion.h"
@@ -35,61 +39,370 @@
 
 // EEPROM functions ------------------------------------------------------------
 
-// Write an 8-bit value to EEPROM memory.
+// Writes are queued and programmed one at a time by the EEPROM Ready
+// interrupt, so a caller doesn't wait the 3.4ms each byte takes to program
+// unless more than EEPROM_QUEUE_SIZE writes are outstanding. Settings
+// change a few bytes at a time, so that's rare. A second write to an
+// address that is still queued replaces the first.
 //
-void eeprom_write(uint16_t address, uint8_t data)
+#define EEPROM_QUEUE_SIZE 4
+
+typedef struct {
+    uint16_t address;
+    uint8_t data;
+} EepromWrite_t;
+
+static EepromWrite_t s_eeprom_queue[EEPROM_QUEUE_SIZE];
+static volatile uint8_t s_eeprom_queue_count;
+
+// Start programming the oldest queued write. Call with interrupts off and
+// the EEPROM idle.
+//
+static void eeprom_write_next(void)
 {
-    // Wait for completion of previous write
-    while(EECR & (1<<EEPE)) {}
-    // Set up Address and Data Registers
-    EEAR = address & 0x0fff; // mask out 512 bytes
-    EEDR = data;
-    // This next critical section cannot have an interrupt occur between the
-    // two writes or the write will fail and we will lose the information,
-    // so disable all interrupts for a moment.
-    cli();
+    EEAR = s_eeprom_queue[0].address & 0x0fff; // mask out 512 bytes
+    EEDR = s_eeprom_queue[0].data;
     // Write logical one to EEMPE (Master Program Enable) to allow us to
-    // write.
+    // write, then within 4 cycles initiate the eeprom write by writing to
+    // the EEPE (Program Enable) strobe.
     EECR |= (1<<EEMPE);
-    // Then within 4 cycles, initiate the eeprom write by writing to the
-    // EEPE (Program Enable) strobe.
     EECR |= (1<<EEPE);
-    // Reenable interrupts.
-    sei();
+
+    --s_eeprom_queue_count;
+    memmove(&s_eeprom_queue[0], &s_eeprom_queue[1],
+            s_eeprom_queue_count * sizeof(EepromWrite_t));
+}
+
+// The EEPROM is ready for another write.
+//
+ISR(EE_READY_vect)
+{
+    if (s_eeprom_queue_count == 0) {
+        // Nothing left to write, stop interrupting.
+        EECR &= ~(1<<EERIE);
+        return;
+    }
+    eeprom_write_next();
+}
+
+// Queue an 8-bit value to be written to EEPROM memory. Only waits if the
+// queue is full.
+//
+void eeprom_write(uint16_t address, uint8_t data)
+{
+    for (;;) {
+        uint8_t sreg = SREG;
+        cli();
+        uint8_t count = s_eeprom_queue_count;
+        for (uint8_t i=0; i<count; ++i) {
+            if (s_eeprom_queue[i].address == address) {
+                s_eeprom_queue[i].data = data;
+                SREG = sreg;
+                return;
+            }
+        }
+        if (count < EEPROM_QUEUE_SIZE) {
+            s_eeprom_queue[count].address = address;
+            s_eeprom_queue[count].data = data;
+            s_eeprom_queue_count = count + 1;
+            EECR |= (1<<EERIE);
+            SREG = sreg;
+            return;
+        }
+        SREG = sreg;
+        // The queue is full, wait for a write to finish and make room.
+        if (!(sreg & _BV(SREG_I))) {
+            eeprom_flush();
+        }
+    }
+}
+
+// Wait until every queued write has been programmed. Needed before
+// anything that resets the chip or leaves interrupts off for good. With
+// interrupts off the queue is written out here instead of by the
+// interrupt.
+//
+void eeprom_flush(void)
+{
+    for (;;) {
+        uint8_t sreg = SREG;
+        cli();
+        bool busy = (EECR & (1<<EEPE)) != 0;
+        if (!busy && s_eeprom_queue_count == 0) {
+            SREG = sreg;
+            return;
+        }
+        if (!busy && !(sreg & _BV(SREG_I))) {
+            eeprom_write_next();
+        }
+        SREG = sreg;
+    }
 }
 
-// Read an 8-bit value from EEPROM memory.
+// Write an 8-bit value to EEPROM memory only if it differs from what is
+// already there. Reading takes a few cycles where a write takes 3.4ms, and
+// every write wears the cell.
+//
+void eeprom_update(uint16_t address, uint8_t data)
+{
+    if (eeprom_read(address) != data) {
+        eeprom_write(address, data);
+    }
+}
+
+// Read an 8-bit value from EEPROM memory. A write still in the queue is
+// the value the cell is about to hold, so that is returned instead.
 //
 uint8_t eeprom_read(uint16_t address)
 {
-    // Wait for completion of previous write
-    while(EECR & (1<<EEPE)) {}
-    // Set up address register
-    EEAR = address;
-    // Start eeprom read by writing EERE (Read Enable)
-    EECR |= (1<<EERE);
-    // Return data from Data Register
-    return EEDR;
+    for (;;) {
+        uint8_t sreg = SREG;
+        cli();
+        for (uint8_t i=0; i<s_eeprom_queue_count; ++i) {
+            if (s_eeprom_queue[i].address == address) {
+                uint8_t data = s_eeprom_queue[i].data;
+                SREG = sreg;
+                return data;
+            }
+        }
+        // The EEPROM can't be read while a write is being programmed.
+        if (!(EECR & (1<<EEPE))) {
+            // Set up address register
+            EEAR = address;
+            // Start eeprom read by writing EERE (Read Enable)
+            EECR |= (1<<EERE);
+            // Return data from Data Register
+            uint8_t data = EEDR;
+            SREG = sreg;
+            return data;
+        }
+        SREG = sreg;
+    }
+}
+
+
+// Runtime state journal -------------------------------------------------------
+
+// State that changes during a performance, like the selected bank, is kept
+// in a journal rather than in fixed cells, which would wear out after
+// ~100,000 writes. Each change appends a record to a ring of records
+// filling EE_JOURNAL_START..EE_JOURNAL_END, so the writes are spread over
+// the whole region:
+//
+//   sequence  field 0  field 1  crc
+//
+// The sequence number goes up by one with each record, so the newest
+// record is the one whose successor doesn't follow on from it. The CRC is
+// written last, and a record with a bad CRC (power lost part way through,
+// or never written) is ignored, leaving the one before it in charge.
+//
+// Changes are only committed once they have settled for JOURNAL_COMMIT_MS,
+// so flicking through banks costs one record rather than dozens, and the
+// writes go through the interrupt driven queue so the main loop never
+// waits.
+
+#define JOURNAL_RECORD_SIZE  (2 + JOURNAL_FIELDS)
+#define JOURNAL_RECORDS      ((EE_JOURNAL_END - EE_JOURNAL_START) / JOURNAL_RECORD_SIZE)
+#define JOURNAL_COMMIT_MS    2000
+
+static uint8_t s_journal_state[JOURNAL_FIELDS];  // Current values.
+static uint8_t s_journal_saved[JOURNAL_FIELDS];  // Values in the newest record.
+static uint8_t s_journal_head;      // Slot of the newest record.
+static uint8_t s_journal_sequence;  // Sequence number of the newest record.
+static bool s_journal_dirty;        // State differs from the newest record?
+static uint16_t s_journal_changed;  // clock_millis() of the last change.
+
+static uint16_t journal_address(const uint8_t slot)
+{
+    return EE_JOURNAL_START + slot * JOURNAL_RECORD_SIZE;
+}
+
+// CRC-8 (polynomial 0x07) of a record's sequence number and fields.
+//
+static uint8_t journal_crc(const uint8_t* data, uint8_t length)
+{
+    uint8_t crc = 0;
+    while (length--) {
+        crc ^= *data++;
+        for (uint8_t i=0; i<8; ++i) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Read the record in "slot" into "record", returning whether it's valid.
+//
+static bool journal_read(const uint8_t slot, uint8_t* record)
+{
+    uint16_t address = journal_address(slot);
+    for (uint8_t i=0; i<JOURNAL_RECORD_SIZE; ++i) {
+        record[i] = eeprom_read(address + i);
+    }
+    return journal_crc(record, JOURNAL_RECORD_SIZE - 1) ==
+           record[JOURNAL_RECORD_SIZE - 1];
+}
+
+// Scan the journal for the newest valid record and load its state. With no
+// valid records the state is all zeros.
+//
+void eeprom_journal_setup(void)
+{
+    uint8_t record[JOURNAL_RECORD_SIZE];
+    uint8_t next[JOURNAL_RECORD_SIZE];
+    bool found = false;
+
+    bool valid = journal_read(0, record);
+    for (uint8_t slot=0; slot<JOURNAL_RECORDS && !found; ++slot) {
+        uint8_t next_slot = (slot + 1) % JOURNAL_RECORDS;
+        bool next_valid = journal_read(next_slot, next);
+        if (valid && (!next_valid || next[0] != (uint8_t)(record[0] + 1))) {
+            // The chain of records ends here.
+            s_journal_head = slot;
+            s_journal_sequence = record[0];
+            memcpy(s_journal_saved, &record[1], JOURNAL_FIELDS);
+            found = true;
+        }
+        memcpy(record, next, JOURNAL_RECORD_SIZE);
+        valid = next_valid;
+    }
+    if (!found) {
+        // Start at the last slot so the first record goes in slot zero.
+        s_journal_head = JOURNAL_RECORDS - 1;
+        s_journal_sequence = 0xff;
+        memset(s_journal_saved, 0, JOURNAL_FIELDS);
+    }
+    memcpy(s_journal_state, s_journal_saved, JOURNAL_FIELDS);
+    s_journal_dirty = false;
+}
+
+// Append the current state to the journal now.
+//
+void eeprom_journal_commit(void)
+{
+    uint8_t record[JOURNAL_RECORD_SIZE];
+    record[0] = s_journal_sequence + 1;
+    memcpy(&record[1], s_journal_state, JOURNAL_FIELDS);
+    record[JOURNAL_RECORD_SIZE - 1] = journal_crc(record, JOURNAL_RECORD_SIZE - 1);
+
+    uint8_t slot = (s_journal_head + 1) % JOURNAL_RECORDS;
+    uint16_t address = journal_address(slot);
+    for (uint8_t i=0; i<JOURNAL_RECORD_SIZE; ++i) {
+        eeprom_write(address + i, record[i]);
+    }
+
+    s_journal_head = slot;
+    s_journal_sequence = record[0];
+    memcpy(s_journal_saved, s_journal_state, JOURNAL_FIELDS);
+    s_journal_dirty = false;
+}
+
+// Zero the runtime state and commit it straight away. This can be called
+// before eeprom_journal_setup(), so the journal is scanned first to find
+// where the next record goes.
+//
+void eeprom_journal_reset(void)
+{
+    eeprom_journal_setup();
+    memset(s_journal_state, 0, JOURNAL_FIELDS);
+    eeprom_journal_commit();
+}
+
+// Return a field of the runtime state.
+//
+uint8_t eeprom_journal_get(const uint8_t field)
+{
+    return s_journal_state[field];
+}
+
+// Change a field of the runtime state. It will be committed once it has
+// stayed put for a while.
+//
+void eeprom_journal_set(const uint8_t field, const uint8_t value)
+{
+    if (s_journal_state[field] == value) return;
+    s_journal_state[field] = value;
+    s_journal_dirty = memcmp(s_journal_state, s_journal_saved, JOURNAL_FIELDS) != 0;
+    s_journal_changed = clock_millis();
+}
+
+// Called once per main loop pass, commits settled changes.
+//
+void eeprom_journal_task(void)
+{
+    if (!s_journal_dirty) return;
+    if ((uint16_t)(clock_millis() - s_journal_changed) < JOURNAL_COMMIT_MS) return;
+    eeprom_journal_commit();
 }
 
 
 // System functions -----------------------------------------------------------
 
-// Set up the EEPROM system for use and read out the settings into the
-// global values.
+// The settings layout. Each setting has one cell, a default value, the
+// range of values it can hold and the layout version it first appeared in,
+// so a layout from older firmware can be brought up to date by filling in
+// only the settings it doesn't have. Add new settings to the end of the
+// table and bump EEPROM_VERSION.
 //
-// This includes checking the layout version and, if the version tag written
-// to the EEPROM doesn't match this software version we're running, we reset
-// the EEPROM values to their default settings.
+typedef struct {
+    uint8_t address;   // EEPROM cell.
+    uint8_t since;     // EEPROM_VERSION that added it.
+    uint8_t fallback;  // Factory default.
+    uint8_t low;       // Lowest value the cell can hold.
+    uint8_t high;      // Highest value the cell can hold.
+} EepromField_t;
+
+static const EepromField_t kEepromFields[] PROGMEM = {
+    {EE_FIRST_BOOT_CHECK,    6, 0xff,          0, 0xff}, // No h/w check on first boot
+    {EE_MIDI_CHANNEL,        6, 2,             0, 15},   // MIDI channel (3)
+    {EE_MIDI_VELOCITY,       6, 127,           1, 127},  // MIDI velocity (127)
+    {EE_KEY_KEYPRESS_LED,    6, 1,             0, 1},    // Light LED of pressed key (on)
+    {EE_KEY_FOURBANKS,       6, FOURBANKS_OFF, 0, 2},    // Fourbanks mode (off)
+    {EE_AUTO_UPDATE,         6, 1,             0, 1},    // Auto update firmware (on)
+    {EE_DEVICE_MODE,         6, TRAKTOR,       0, 3},    // Default mode is Traktor
+    {EE_COMBOS_ENABLE,       6, 1,             0, 1},    // Combos (on)
+    {EE_ROTATE_ENABLE,       6, 0,             0, 1},    // Rotate (off)
+    {EE_LED_METER_CC,        7, 80,            0, 127},  // Level meter CC (80)
+    {EE_LED_METER_POSITION,  7, 0,             0, 8},    // Level meter (off)
+    {EE_CLOCK_MASTER,        8, 0,             0, 1},    // Master clock (off)
+    {EE_CLOCK_TAP_KEY,       8, 0,             0, 15},   // Tap tempo key (top left)
+    {EE_LED_BLINK_ENABLE,   10, 0,             0, 1},    // Blink states (off)
+};
+
+#define EEPROM_FIELD_COUNT (sizeof(kEepromFields) / sizeof(kEepromFields[0]))
+
+// Write the default of every setting newer than layout "version". Cells
+// that already hold the value are left alone.
 //
-void eeprom_setup(void)
+static void eeprom_defaults(const uint8_t version)
 {
-    // If our EEPROM layout has changed, reset everything.
-    if (eeprom_read(EE_EEPROM_VERSION) != EEPROM_VERSION) {
-        eeprom_factory_reset();
+    for (uint8_t i=0; i<EEPROM_FIELD_COUNT; ++i) {
+        if (pgm_read_byte(&kEepromFields[i].since) > version) {
+            eeprom_update(pgm_read_byte(&kEepromFields[i].address),
+                          pgm_read_byte(&kEepromFields[i].fallback));
+        }
+    }
+}
+
+// Can "value" be written to the EEPROM cell at "address"? Settings cells
+// are checked against their range in the table above and preset slot cells
+// against the setting they hold. Any other cell can take any value.
+//
+bool eeprom_value_valid(const uint16_t address, const uint8_t value)
+{
+    for (uint8_t i=0; i<EEPROM_FIELD_COUNT; ++i) {
+        if (pgm_read_byte(&kEepromFields[i].address) == address) {
+            return value >= pgm_read_byte(&kEepromFields[i].low) &&
+                   value <= pgm_read_byte(&kEepromFields[i].high);
+        }
     }
+    return preset_value_valid(address, value);
+}
 
-    // Read the EEPROM into the global settings.
+// Read the EEPROM into the global settings.
+//
+void eeprom_load(void)
+{
     g_self_test_passed = eeprom_read(EE_FIRST_BOOT_CHECK);
     g_midi_channel = eeprom_read(EE_MIDI_CHANNEL);
     g_midi_velocity = eeprom_read(EE_MIDI_VELOCITY);
@@ -102,24 +415,88 @@ void eeprom_setup(void)
     g_combos_enable = eeprom_read(EE_COMBOS_ENABLE);
     //g_multiplexer_enable = eeprom_read(EE_MULTIPLEXER_ENABLE);
 	g_rotate_enable = eeprom_read(EE_ROTATE_ENABLE);
+    g_led_meter_cc = eeprom_read(EE_LED_METER_CC);
+    g_led_meter_position = eeprom_read(EE_LED_METER_POSITION);
+    g_clock_master = eeprom_read(EE_CLOCK_MASTER);
+    g_clock_tap_key = eeprom_read(EE_CLOCK_TAP_KEY);
+    g_led_blink_enable = eeprom_read(EE_LED_BLINK_ENABLE);
+}
+
+// Bring a layout from older firmware up to date, keeping the user's
+// settings. New settings get their defaults from the field table, anything
+// else that changed between versions is converted here, one version step
+// at a time.
+//
+static void eeprom_migrate(const uint8_t version)
+{
+    eeprom_defaults(version);
+    eeprom_load();
+
+    switch (version) {
+    case 6:
+    case 7:
+        // Versions 7 and 8 only added settings.
+    case 8:
+        // Version 9 added preset slots, they start out as copies of the
+        // current settings.
+        preset_reset();
+    case 9:
+        // Version 10 only added a setting.
+        break;
+    }
+
+    // Written last, so a migration cut short by a power loss runs again.
+    eeprom_write(EE_EEPROM_VERSION, EEPROM_VERSION);
+}
+
+// Set up the EEPROM system for use and read out the settings into the
+// global values.
+//
+// This includes checking the layout version. A layout written by older
+// firmware is migrated, keeping the user's settings. Anything else that
+// doesn't match, such as a blank EEPROM or a layout from newer firmware,
+// is reset to the factory defaults.
+//
+void eeprom_setup(void)
+{
+    uint8_t version = eeprom_read(EE_EEPROM_VERSION);
+    if (version == EEPROM_VERSION) {
+        eeprom_load();
+    } else if (version >= EEPROM_OLDEST_VERSION && version < EEPROM_VERSION) {
+        eeprom_migrate(version);
+    } else {
+        eeprom_factory_reset();
+    }
+
+    // Find the most recent runtime state.
+    eeprom_journal_setup();
 }
 
 // Used by the menu system, if we have edited any of the global values then
-// save them off to the EEPROM.
+// save them off to the EEPROM. Only the settings that have changed are
+// written.
 //
 void eeprom_save_edits(void)
 {
-    eeprom_write(EE_MIDI_CHANNEL, g_midi_channel);
-    eeprom_write(EE_MIDI_VELOCITY, g_midi_velocity);
-    eeprom_write(EE_KEY_KEYPRESS_LED, g_led_keypress_enable);
-    eeprom_write(EE_KEY_FOURBANKS, g_key_fourbanks_mode);
-    //eeprom_write(EE_EXP_DIGITAL_ENABLED, g_exp_digital_read);
-    //eeprom_write(EE_EXP_ANALOG_ENABLED, g_exp_analog_read);
-    eeprom_write(EE_AUTO_UPDATE, g_auto_update);
-    eeprom_write(EE_DEVICE_MODE, g_device_mode);
-    eeprom_write(EE_COMBOS_ENABLE, g_combos_enable);
-    //eeprom_write(EE_MULTIPLEXER_ENABLE, g_multiplexer_enable);
-	eeprom_write(EE_ROTATE_ENABLE, g_rotate_enable);
+    eeprom_update(EE_MIDI_CHANNEL, g_midi_channel);
+    eeprom_update(EE_MIDI_VELOCITY, g_midi_velocity);
+    eeprom_update(EE_KEY_KEYPRESS_LED, g_led_keypress_enable);
+    eeprom_update(EE_KEY_FOURBANKS, g_key_fourbanks_mode);
+    //eeprom_update(EE_EXP_DIGITAL_ENABLED, g_exp_digital_read);
+    //eeprom_update(EE_EXP_ANALOG_ENABLED, g_exp_analog_read);
+    eeprom_update(EE_AUTO_UPDATE, g_auto_update);
+    eeprom_update(EE_DEVICE_MODE, g_device_mode);
+    eeprom_update(EE_COMBOS_ENABLE, g_combos_enable);
+    //eeprom_update(EE_MULTIPLEXER_ENABLE, g_multiplexer_enable);
+	eeprom_update(EE_ROTATE_ENABLE, g_rotate_enable);
+    eeprom_update(EE_LED_METER_CC, g_led_meter_cc);
+    eeprom_update(EE_LED_METER_POSITION, g_led_meter_position);
+    eeprom_update(EE_CLOCK_MASTER, g_clock_master);
+    eeprom_update(EE_CLOCK_TAP_KEY, g_clock_tap_key);
+    eeprom_update(EE_LED_BLINK_ENABLE, g_led_blink_enable);
+
+    // The live settings belong to the active preset.
+    preset_store();
 }
 
 // Return the EEPROM values to their factory default values, erasing any
@@ -130,28 +507,21 @@ void eeprom_factory_reset(void)
     // NOTE: hardware check on first boot only occurs if the eeprom was zeroed.
     // and not every time we reflash an eeprom. That keeps it a rare event.
 
-    eeprom_write(EE_EEPROM_VERSION,      EEPROM_VERSION); // This layout version
-    eeprom_write(EE_FIRST_BOOT_CHECK,    0xff); // No h/w check on first boot
-
-    // Reset the global variables to their default versions, as they were
-    // read with their old values before the factory reset happened and they
-    // could get written back if the user leaves menu mode through the exit
-    // button.
-    g_self_test_passed = 0xff;
-
-    g_midi_channel = 2;                     // MIDI channel (3)
-    g_midi_velocity = 127;                  // MIDI velocity (127)
-    g_led_keypress_enable = 1;              // Light LED of pressed key (on)
-    g_key_fourbanks_mode = FOURBANKS_OFF;   // Fourbanks mode (off)
-    //g_exp_digital_read = 0;                 // Read from digital (all off)
-    //g_exp_analog_read = 0;                  // Read from analog (all off)
-    g_auto_update = 1;                      // Auto update firmware (on)
-    g_device_mode = TRAKTOR;                // Default mode is Traktor
-    g_combos_enable = 1;                    // Combos (on)
-    //g_multiplexer_enable = 0;               // Multiplexer (off)
-	g_rotate_enable = 0;
-    // Save changes
-    eeprom_save_edits();
+    eeprom_defaults(0);
+
+    // Reload the global variables, as they were read with their old values
+    // before the factory reset happened and they could get written back if
+    // the user leaves menu mode through the exit button.
+    eeprom_load();
+
+    // Forget the runtime state as well.
+    eeprom_journal_reset();
+
+    // Every preset starts out with the defaults.
+    preset_reset();
+
+    // Written last, so a reset cut short by a power loss runs again.
+    eeprom_update(EE_EEPROM_VERSION, EEPROM_VERSION); // This layout version
 
     // Flash to signal success.
     led_set_state(0xffff);
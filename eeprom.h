@@ -26,9 +26,26 @@
 // EEPROM functions -----------------------------------------------
 
 void eeprom_write(uint16_t address, uint8_t data);
+void eeprom_update(uint16_t address, uint8_t data);
+void eeprom_flush(void);
+
+// Runtime state journal ------------------------------------------
+
+#define JOURNAL_BANK    0  // Selected bank (0..3).
+#define JOURNAL_PRESET  1  // Active preset slot (0..3).
+#define JOURNAL_FIELDS  2
+
+void eeprom_journal_setup(void);
+void eeprom_journal_commit(void);
+void eeprom_journal_reset(void);
+void eeprom_journal_task(void);
+uint8_t eeprom_journal_get(const uint8_t field);
+void eeprom_journal_set(const uint8_t field, const uint8_t value);
 uint8_t eeprom_read(uint16_t address);
 void eeprom_factory_reset(void);
 void eeprom_setup(void);
+void eeprom_load(void);
+bool eeprom_value_valid(const uint16_t address, const uint8_t value);
 void eeprom_save_edits(void);
 
 #endif // _EEPROM_H_INCLUDED
@@ -47,6 +47,10 @@ uint8_t g_exp_key_up;
 // the value changes.
 uint16_t g_exp_analog_prev[NUM_ANALOG];
 
+// Expansion LED state waiting to be shifted out by the key read ISR.
+static volatile uint8_t s_exp_led_state = 0;
+static volatile bool s_exp_led_dirty = false;
+
 
 // Functions -----------------------------------------------------------------
 
@@ -80,6 +84,9 @@ void exp_setup()
         g_exp_analog_prev[i] = exp_adc_read(i);
     }
 
+    // The key read ISR is already running, but only now are the LED pins
+    // outputs, so only now have it clear the LEDs.
+    s_exp_led_dirty = true;
 }
 
 // This function is designed to be used inside the key-read interrupt
@@ -209,13 +216,14 @@ uint16_t exp_adc_read(uint8_t channel)
 
 // ---------------------------------------------------------------------------
 
+// Record a new state for the expansion key LEDs. The LEDs and the
+// expansion key reads share the same clock lines, so rather than shifting
+// the bits out here with interrupts off, we leave the new state for the
+// key read ISR to send on its next pass. Nothing is sent if the state
+// hasn't changed.
+//
 void exp_set_key_led(uint8_t state)
 {
-    // Turn off interrupts because the external LEDs and the external Key
-    // Read lines share the same clock lines. An interrupt in the middle of
-    // this sequence will give you corrupt LEDs.
-    cli();
-
 	// The only device configuration which uses reordering of the external key
 	// is Serato, if rotate is enabled then we dont want to reorder the keys
 if(!g_rotate_enable)
@@ -233,6 +241,24 @@ if(!g_rotate_enable)
 #endif
 }
 
+    // Both are single byte writes so the ISR never sees half an update,
+    // at worst it picks up the new state one pass later.
+    if (state != s_exp_led_state) {
+        s_exp_led_state = state;
+        s_exp_led_dirty = true;
+    }
+}
+
+// Shift the pending LED state out to the expansion LED controller. Like
+// exp_buffer_digital_inputs() this is called from inside the key-read
+// interrupt service routine, which already owns the shared clock lines, so
+// it doesn't need to disable interrupts.
+//
+void exp_update_key_leds(void)
+{
+    if (!s_exp_led_dirty) return;
+    s_exp_led_dirty = false;
+    uint8_t state = s_exp_led_state;
 
     // set the EXP_LED_BIT to an output, no pullup.
     DDRD |= EXP_LED_BIT;
@@ -264,9 +290,6 @@ if(!g_rotate_enable)
     PORTD |= EXP_LED_LATCH;
     // leave the latch low
     PORTD &= ~EXP_LED_LATCH;
-
-    // Turn interrupts back on now we're leaving the critical section.
-    sei();
 }
 
 // ----------------------------------------------------------------------------
@@ -54,6 +54,7 @@ uint8_t exp_key_read(void);
 void exp_key_calc(void);
 
 void exp_set_key_led(uint8_t state);
+void exp_update_key_leds(void);
 
 uint16_t exp_adc_read(uint8_t channel);
 
@@ -27,6 +27,7 @@
 #include "modeldefs.h"  // NOTE: include this first.
 
 #include "key.h"
+#include "clock.h"
 #include "random.h"
 #include "constants.h"
 #include "expansion.h"
@@ -45,6 +46,14 @@ uint16_t g_key_prev_state = 0; // State of the keys when last polled.
 uint16_t g_key_up = 0;         // Key was released since last poll.
 uint16_t g_key_down = 0;       // Key was pressed since last poll.
 
+// Press and release times of one key, taken by the scan interrupt so they
+// don't pick up the main loop's timing. They follow the debouncer, which
+// ANDs the samples: a press is the start of a run of DEBOUNCE_BUFFER_SIZE
+// samples with the key down, a release the first sample with it up.
+uint8_t g_key_timed = 0;                     // Key to time (0..15).
+static volatile uint16_t s_key_timed_down;   // clock_millis() of the press.
+static volatile uint16_t s_key_timed_up;     // clock_millis() of the release.
+
 
 // Key Functions --------------------------------------------------
 
@@ -168,6 +177,26 @@ else
 
 	
 
+    // Timestamp the timed key. Both times are published on the sample that
+    // makes key_read() report the change, and before that sample goes into
+    // the buffer, so the main loop never sees a transition without its time.
+    static uint8_t timed_run = 0;     // Samples the key has been down.
+    static uint16_t timed_start = 0;  // clock_millis() of the run's start.
+    if (value & (1 << g_key_timed)) {
+        if (timed_run == 0) {
+            timed_start = clock_millis();
+        }
+        if (timed_run < DEBOUNCE_BUFFER_SIZE &&
+            ++timed_run == DEBOUNCE_BUFFER_SIZE) {
+            s_key_timed_down = timed_start;
+        }
+    } else {
+        if (timed_run == DEBOUNCE_BUFFER_SIZE) {
+            s_key_timed_up = clock_millis();
+        }
+        timed_run = 0;
+    }
+
     // Store the new value in our ring buffer and increment the ring buffer
     // offset, wrapping the write position to a point inside the buffer.
     g_key_debounce_buffer[buffer_pos] = value;
@@ -175,6 +204,31 @@ else
 
     // buffer the external keys
     exp_buffer_digital_inputs();
+
+    // send any change to the external key LEDs, which share the same clock
+    // lines.
+    exp_update_key_leds();
+}
+
+// Return when the timed key was last pressed or released, in clock_millis()
+// time.
+//
+uint16_t key_timed_down(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t time = s_key_timed_down;
+    SREG = sreg;
+    return time;
+}
+
+uint16_t key_timed_up(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t time = s_key_timed_up;
+    SREG = sreg;
+    return time;
 }
 
 // Read the current keystate by reconstructing the key samples from the
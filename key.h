@@ -53,6 +53,9 @@ extern uint16_t g_key_prev_state; // State of the keys when last polled.
 extern uint16_t g_key_up;         // Key was released since last poll.
 extern uint16_t g_key_down;       // Key was pressed since last poll.
 
+// Key whose press and release are timestamped by the scan interrupt.
+extern uint8_t g_key_timed;
+
 // Interrupt service routine ---------------------------------------------------
 
 ISR(TIMER0_OVF_vect);
@@ -63,5 +66,7 @@ void key_setup(void);
 void key_disable(void);
 uint16_t key_read(void);
 void key_calc(void);
+uint16_t key_timed_down(void);
+uint16_t key_timed_up(void);
 
 #endif // _KEY_H_INCLUDED
@@ -22,6 +22,7 @@
 
 #include <stdbool.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 
 #include "modeldefs.h"  // NOTE: include this first.
@@ -31,6 +32,7 @@
 #include "random.h"
 #include "constants.h"
 #include "key.h"
+#include "clock.h"
 
 // Global variables ------------------------------------------------------------
 
@@ -39,7 +41,36 @@ bool g_exp_led_keypress_enable = true;   // light the expansion led when pressed
 uint16_t g_led_midi_state = 0x0000;  // Persistent LED state from midi commands.
 uint16_t g_led_state = 0x0000;       // Current LED state, copied from last
                                      // call to led_set_state()
-uint16_t g_led_groundfx_counter = 0; // Counter for the ground FX MIDI clock.
+uint8_t g_led_meter_cc = 80;         // CC on our channel driving the meter.
+uint8_t g_led_meter_position = 0;    // Where to draw the meter (0 = off).
+uint8_t g_led_meter_level = 0;       // Last meter level received (0..127).
+bool g_led_blink_enable = false;     // Do velocities select blink states?
+
+// Blink state tables, indexed by the top three bits of a note velocity, used
+// when blink states are enabled (config tag 0x0F, off by default). The
+// period and the number of ticks the LED stays lit are both measured in MIDI
+// clock ticks, and a period of zero means the LED is lit continuously.
+//
+//   velocity   range   display
+//   --------   -----   -------
+//     1..15      0     on
+//    16..31      1     blink every 1/4 beat
+//    32..47      2     blink every 1/2 beat
+//    48..63      3     blink every beat
+//    64..79      4     blink every 2 beats
+//    80..95      5     blink every bar
+//    96..111     6     pulse, a short flash on every beat
+//   112..127     7     on
+//
+// A velocity of zero is always off. The "PROGMEM" setting keeps the tables
+// out of RAM.
+//
+const uint8_t kBlinkPeriod[8] PROGMEM = {
+    0, 6, 12, 24, 48, 96, 24, 0
+};
+const uint8_t kBlinkOnTicks[8] PROGMEM = {
+    0, 3,  6, 12, 24, 48,  3, 0
+};
 
 // Basic functions -------------------------------------------------------------
 
@@ -119,6 +150,123 @@ void led_groundfx_state(bool state)
     }
 }
 
+// Blink states ----------------------------------------------------------------
+
+// Calculate which of the eight velocity ranges should be lit at a position
+// in the bar (0..95 MIDI clock ticks), returning one bit per range. This
+// only needs calculating once per LED update, after which each note can be
+// tested cheaply with led_velocity_lit().
+//
+// The blinks are phase locked to the incoming 0xF8 clock by passing in the
+// position from the clock tracker. With no clock running, or once it has
+// stalled, the tracker rewinds the position to zero, which is inside the
+// "on" part of every blink, so blinking pads show as lit.
+//
+// With blink states turned off every range is lit, so any velocity other
+// than zero lights the pad, as older firmware did.
+//
+uint8_t led_blink_mask(const uint8_t bar_tick)
+{
+    if (!g_led_blink_enable) return 0xff;
+    uint8_t tick = bar_tick % MIDI_CLOCK_TICKS_PER_BAR;
+    uint8_t mask = 0;
+    uint8_t bit = 0x01;
+    for (uint8_t i=0; i<8; ++i) {
+        uint8_t period = pgm_read_byte(&kBlinkPeriod[i]);
+        if (period == 0 ||
+            (tick % period) < pgm_read_byte(&kBlinkOnTicks[i])) {
+            mask |= bit;
+        }
+        bit <<= 1;
+    }
+    return mask;
+}
+
+// Is a note with this velocity lit right now? Zero velocity is a NoteOff
+// and never lit.
+//
+bool led_velocity_lit(const uint8_t blink_mask, const uint8_t velocity)
+{
+    if (velocity == 0) return false;
+    return (blink_mask & (1 << (velocity >> 4))) != 0;
+}
+
+// Level meter -----------------------------------------------------------------
+
+// Bar patterns for the level meter, one row of five patterns for each of
+// the eight places the meter can be drawn, holding zero to four lit
+// segments. Rows fill from left to right and columns from the bottom up,
+// e.g. column 2 with three segments lit:
+//
+//    .  .  .  .
+//    .  #  .  .
+//    .  #  .  .
+//    .  #  .  .
+//
+const uint16_t kMeterBars[8][5] PROGMEM = {
+    { 0x0000, 0x0001, 0x0003, 0x0007, 0x000f },  // 1 = top row
+    { 0x0000, 0x0010, 0x0030, 0x0070, 0x00f0 },  // 2 = second row
+    { 0x0000, 0x0100, 0x0300, 0x0700, 0x0f00 },  // 3 = third row
+    { 0x0000, 0x1000, 0x3000, 0x7000, 0xf000 },  // 4 = bottom row
+    { 0x0000, 0x1000, 0x1100, 0x1110, 0x1111 },  // 5 = left column
+    { 0x0000, 0x2000, 0x2200, 0x2220, 0x2222 },  // 6 = second column
+    { 0x0000, 0x4000, 0x4400, 0x4440, 0x4444 },  // 7 = third column
+    { 0x0000, 0x8000, 0x8800, 0x8880, 0x8888 },  // 8 = right column
+};
+
+// Draw the level meter over an LED pattern, replacing whatever the MIDI
+// state had put in the meter's row or column. The host only has to send a
+// single CC to update the whole bar.
+//
+uint16_t led_meter_overlay(uint16_t leds)
+{
+    if (g_led_meter_position == 0 || g_led_meter_position > 8) {
+        return leds;
+    }
+    const uint16_t* bars = kMeterBars[g_led_meter_position - 1];
+    // Any signal at all lights the first segment, 127 lights all four.
+    uint8_t segments = (g_led_meter_level + 31) >> 5;
+    leds &= ~pgm_read_word(&bars[4]);
+    leds |= pgm_read_word(&bars[segments]);
+    return leds;
+}
+
+// Confirmation flash ----------------------------------------------------------
+
+// Flash each row in turn from the top, 75ms on and 75ms off, to confirm
+// that new settings have arrived. The flash is drawn over the normal
+// display by led_flash_overlay() so nothing has to wait for it.
+//
+#define FLASH_STEP_MS 150
+#define FLASH_ON_MS   75
+#define FLASH_STEPS   4
+
+static bool s_led_flash_active;
+static uint16_t s_led_flash_start;  // clock_millis() when the flash began.
+
+void led_flash_start(void)
+{
+    s_led_flash_start = clock_millis();
+    s_led_flash_active = true;
+}
+
+// Replace the LED pattern with the flash while it's running.
+//
+uint16_t led_flash_overlay(uint16_t leds)
+{
+    if (!s_led_flash_active) return leds;
+    uint16_t elapsed = clock_millis() - s_led_flash_start;
+    uint8_t step = elapsed / FLASH_STEP_MS;
+    if (elapsed >= FLASH_STEPS * FLASH_STEP_MS) {
+        s_led_flash_active = false;
+        return leds;
+    }
+    if (elapsed - step * FLASH_STEP_MS >= FLASH_ON_MS) {
+        return 0x0000;
+    }
+    return 0x000f << (4 * step);
+}
+
 // Lightshow effects -----------------------------------------------------------
 
 // Turn each LED on for a short time, one by one.  Note the blocking
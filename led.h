@@ -30,7 +30,10 @@
 extern bool g_led_keypress_enable;   // Light the LED when a key is pressed?
 extern bool g_exp_led_keypress_enable;
 extern uint16_t g_led_state;         // Copy of the last led state set
-extern uint16_t g_led_groundfx_counter;   // Ground fx MIDI clock counter.
+extern uint8_t g_led_meter_cc;       // CC that drives the level meter.
+extern uint8_t g_led_meter_position; // Meter row or column (0 = off).
+extern bool g_led_blink_enable;      // Do velocities select blink states?
+extern uint8_t g_led_meter_level;    // Most recent level from the host.
 
 // Basic functions ------------------
 
@@ -38,6 +41,20 @@ void led_setup(void);
 void led_set_state(uint16_t new_state);
 void led_groundfx_state(bool state);
 
+// Confirmation flash ---------------
+
+void led_flash_start(void);
+uint16_t led_flash_overlay(uint16_t leds);
+
+// Blink states ---------------------
+
+uint8_t led_blink_mask(const uint8_t bar_tick);
+bool led_velocity_lit(const uint8_t blink_mask, const uint8_t velocity);
+
+// Level meter ----------------------
+
+uint16_t led_meter_overlay(uint16_t leds);
+
 // Lightshow effects ----------------
 
 void led_count_all_leds(void);
@@ -22,11 +22,15 @@
 
 #include <string.h>  // for memset()
 #include <avr/pgmspace.h>
+#include <avr/interrupt.h>
 
 #include "constants.h"
 #include "usb_descriptors.h"
 #include "key.h"
+#include "clock.h"
+#include "expansion.h"
 #include "midi.h"
+#include "sysex.h"
 
 // Global variables ------------------------------------------------------------
 
@@ -38,10 +42,10 @@ static USB_ClassInfo_MIDI_Device_t s_midi_interface = {
         .StreamingInterfaceNumber = 1,
         .DataINEndpointNumber      = MIDI_STREAM_IN_EPNUM,
         .DataINEndpointSize        = MIDI_STREAM_EPSIZE,
-        .DataINEndpointDoubleBank  = false,
+        .DataINEndpointDoubleBank  = true,
         .DataOUTEndpointNumber     = MIDI_STREAM_OUT_EPNUM,
         .DataOUTEndpointSize       = MIDI_STREAM_EPSIZE,
-        .DataOUTEndpointDoubleBank = false,
+        .DataOUTEndpointDoubleBank = true,
     },
 };
 
@@ -75,12 +79,122 @@ const uint8_t kNoteMap[16] PROGMEM = {
 uint8_t g_midi_channel = 14;      // MIDI channel to listen and send on (0..15)
 uint8_t g_midi_velocity = 74;     // Default velocity for NoteOn (0..127)
 
-// A copy of the most recent velocity for each MIDI note.
-uint8_t g_midi_note_state[MIDI_MAX_NOTES];
-
-// Save a little storage by preallocating and reusing space for the MIDI
-// event packet.
-static MIDI_EventPacket_t midi_event;
+// MIDI note state. Every note gets an on/off bit, but only the notes that
+// can ever be shown on an LED keep a velocity, as that's the only place a
+// velocity is read. Those are the 64 notes of the four banks and the four
+// expansion port keys, and the LEDs only look at the top bits of the
+// velocity so each one keeps a nibble, the velocity in steps of 8.
+//
+#define NOTE_CACHE_BANKS  64  // Notes MIDI_BASE_NOTE up.
+#define NOTE_CACHE_SIZE   (NOTE_CACHE_BANKS + 4)
+static uint8_t s_midi_note_on[MIDI_MAX_NOTES / 8];
+static uint8_t s_midi_note_velocity[NOTE_CACHE_SIZE / 2];
+
+// Outbound event queue. Events are queued here and copied into the IN
+// endpoint whenever the host has room for them, so a host that isn't
+// listening can never stall the main loop. When the queue is full we fall
+// back on these policies:
+//
+//   - CCs are coalesced, a new value for a controller that is still
+//     waiting in the queue replaces the old value.
+//   - LED echoes (the CCs sent alongside notes in Ableton mode) are
+//     dropped once the queue is three quarters full, they only mirror
+//     state that the next keypress will resend.
+//   - NoteOffs are held back rather than dropped. If there is no room
+//     they are recorded, with the channel and velocity they were sent
+//     with, and queued as soon as room appears, ahead of anything newer.
+//     Only if MIDI_PENDING_SIZE are already waiting is one dropped.
+//   - Anything else is dropped and counted.
+//   - SysEx on the configuration cable can't use the last few slots, so
+//     a long reply can never lock out performance events.
+//
+// The queue is kept in order, oldest event first, so that it doubles as
+// the frame buffer for the IN endpoint: one USB packet is written straight
+// from the front of the queue with a single stream write. Performance
+// events are always kept ahead of configuration events, so a config dump
+// never delays a NoteOn. Each cable is its own MIDI stream, so this
+// reordering is invisible to the host.
+//
+static MIDI_EventPacket_t s_midi_queue[MIDI_QUEUE_SIZE];
+static uint8_t s_midi_queue_count;   // Number of events waiting.
+static uint8_t s_midi_queue_perf;    // How many of those are performance.
+static uint16_t s_midi_queue_frame;  // clock_millis() the oldest event arrived.
+
+// NoteOffs that didn't fit in the queue, oldest first, with the channel
+// and velocity they were sent with. The queue only stays full while the
+// host isn't reading, so this only has to cover the keys that are released
+// in that time.
+#define MIDI_PENDING_SIZE 8
+typedef struct {
+    uint8_t status;
+    uint8_t note;
+    uint8_t velocity;
+} MidiPendingOff_t;
+static MidiPendingOff_t s_midi_pending_off[MIDI_PENDING_SIZE];
+static uint8_t s_midi_pending_count;
+
+// System Real Time priority lane. Timing messages are written straight
+// into a free IN endpoint bank the moment they are generated, skipping the
+// queue entirely. If both banks are busy they wait here and go out at the
+// front of the next packet.
+//
+#define MIDI_REALTIME_SIZE 4
+static uint8_t s_midi_realtime[MIDI_REALTIME_SIZE];
+static uint8_t s_midi_realtime_count;
+
+uint16_t g_midi_tx_dropped = 0;   // Events discarded because the queue was full.
+uint16_t g_midi_tx_deferred = 0;  // NoteOffs held back until there was room.
+uint16_t g_midi_tx_packets = 0;   // USB packets sent to the host.
+uint8_t g_midi_tx_last_batch = 0; // Events in the most recent packet.
+uint8_t g_midi_tx_peak_batch = 0; // Most events ever sent in one packet.
+uint8_t g_midi_tx_peak_wait = 0;  // Most milliseconds an event has waited.
+
+// Number of events that fit in one USB packet.
+#define EVENTS_PER_PACKET (MIDI_STREAM_EPSIZE / sizeof(MIDI_EventPacket_t))
+
+// How an event should be treated when the queue is under pressure.
+#define QUEUE_NORMAL    0
+#define QUEUE_COALESCE  1   // Replace a queued event for the same controller.
+#define QUEUE_ECHO      2   // Droppable LED echo, also coalesced.
+
+// Queue slots kept free of configuration SysEx.
+#define QUEUE_PERF_RESERVE  4
+
+// USB-MIDI Code Index Number of a NoteOff.
+#define CIN_NOTE_OFF    0x8
+
+// Redundant message suppression. We remember which notes we have turned on
+// and the last value sent on each analog CC, all on our own MIDI channel,
+// and never send the same state twice in a row. Only NoteOns are checked,
+// as a note's bit can't tell "sent a NoteOff" from "never sent anything",
+// and after a reset a key may still be held down. A repeated NoteOff is
+// harmless and rare, a missing one leaves a note hanging.
+static uint8_t s_midi_sent_notes[MIDI_MAX_NOTES / 8];
+static uint8_t s_midi_cc_shadow[2 * NUM_ANALOG];  // 0xff = not sent yet
+static uint8_t s_midi_shadow_channel;             // Channel the above are for.
+
+uint16_t g_midi_tx_suppressed = 0;  // Messages not sent as they were repeats.
+uint16_t g_midi_rx_deferred = 0;    // Packets left for the next pass.
+
+// Outbound SysEx writer. One message at a time is fed into the queue from
+// its byte source by midi_sysex_task(), a packet at a time as room appears
+// on its cable, so a long reply goes out alongside the performance events
+// and nothing ever waits for it. Messages from RAM are copied into
+// g_sysex_scratch, as the caller's buffer is gone by the time they are
+// sent. The SysEx command handlers are the only other users of the scratch
+// buffer, and SysEx input is held back while a message is being written,
+// so they never run while it's in use.
+static MidiByteSource s_midi_sysex_source;  // 0 when there's no message.
+static const void* s_midi_sysex_context;
+static uint16_t s_midi_sysex_length;        // Length of the message.
+static uint16_t s_midi_sysex_index;         // Next byte to send.
+static uint8_t s_midi_sysex_cable;
+static uint16_t s_midi_sysex_time;          // clock_millis() of the last packet.
+static bool s_midi_sysex_abort;             // Close the message with an F7.
+
+// Cable to send SysEx on. Replies go back on the cable the request arrived
+// on, anything else goes out on the configuration cable.
+uint8_t g_midi_sysex_cable = MIDI_CABLE_CONFIG;
 
 
 // MIDI functions -------------------------------------------------------------
@@ -93,143 +207,622 @@ void midi_setup(void)
 
     // basenote, expnote, channel and velocity have already been set up via
     // the EEPROM settings. Clear the MIDI keystate.
-    memset(g_midi_note_state, 0, MIDI_MAX_NOTES);
+    memset(s_midi_note_on, 0, sizeof(s_midi_note_on));
+    memset(s_midi_note_velocity, 0, sizeof(s_midi_note_velocity));
+
+    midi_clear_queue();
 }
 
-// Append a MIDI note change event (note on or off) to the currently
-// selected USB endpoint. If the endpoint is full it will be flushed.
+// Throw away everything waiting to be sent, e.g. when the host has
+// reconfigured the device.
 //
-//  pitch    Pitch of the note to turn on or off.
-//  onoff    True for a NoteOn, false for a NoteOff.
+void midi_clear_queue(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    s_midi_queue_count = 0;
+    s_midi_queue_perf = 0;
+    s_midi_realtime_count = 0;
+    s_midi_pending_count = 0;
+    s_midi_sysex_source = 0;
+    SREG = sreg;
+
+    // The host starts from scratch too, so forget what we've sent.
+    s_midi_shadow_channel = 0xff;
+}
+
+// Make sure the suppression state is for the current MIDI channel, it
+// means nothing if the channel has changed.
+//
+static void midi_shadow_check_channel(void)
+{
+    if (s_midi_shadow_channel != g_midi_channel) {
+        memset(s_midi_sent_notes, 0, sizeof(s_midi_sent_notes));
+        memset(s_midi_cc_shadow, 0xff, sizeof(s_midi_cc_shadow));
+        s_midi_shadow_channel = g_midi_channel;
+    }
+}
+
+// Append an event to the tail of the queue. The caller has already checked
+// there is room.
+//
+// NOTE: The queue is emptied from the USB Start of Frame interrupt, so
+// everything that touches it from the main loop must do so with interrupts
+// turned off.
+//
+static void midi_queue_push(const uint8_t cable,
+                            const uint8_t cin,
+                            const uint8_t data1,
+                            const uint8_t data2,
+                            const uint8_t data3)
+{
+    if (s_midi_queue_count == 0) {
+        s_midi_queue_frame = clock_millis();
+    }
+    uint8_t slot = s_midi_queue_count;
+    if (cable == MIDI_CABLE_PERFORMANCE) {
+        // Slot in after the last performance event, moving any
+        // configuration events back to make room.
+        slot = s_midi_queue_perf++;
+        memmove(&s_midi_queue[slot + 1], &s_midi_queue[slot],
+                (s_midi_queue_count - slot) * sizeof(MIDI_EventPacket_t));
+    }
+    MIDI_EventPacket_t* event = &s_midi_queue[slot];
+    event->CableNumber = cable;  // USB-MIDI virtual cable (0..15)
+    event->Command     = cin;
+    event->Data1       = data1;
+    event->Data2       = data2;
+    event->Data3       = data3;
+    ++s_midi_queue_count;
+}
+
+// Move any deferred NoteOffs into the queue while there is room for them.
+//
+static void midi_queue_promote_pending(void)
+{
+    uint8_t count = 0;
+    while (count < s_midi_pending_count &&
+           s_midi_queue_count < MIDI_QUEUE_SIZE) {
+        MidiPendingOff_t* off = &s_midi_pending_off[count++];
+        midi_queue_push(MIDI_CABLE_PERFORMANCE, CIN_NOTE_OFF,
+                        off->status, off->note, off->velocity);
+    }
+    if (count) {
+        s_midi_pending_count -= count;
+        memmove(&s_midi_pending_off[0], &s_midi_pending_off[count],
+                s_midi_pending_count * sizeof(MidiPendingOff_t));
+    }
+}
+
+// Hold back a NoteOff that doesn't fit in the queue. Returns false if there
+// is nowhere left to keep it.
+//
+static bool midi_queue_defer(const uint8_t status,
+                             const uint8_t note,
+                             const uint8_t velocity)
+{
+    if (s_midi_pending_count >= MIDI_PENDING_SIZE) return false;
+    MidiPendingOff_t* off = &s_midi_pending_off[s_midi_pending_count++];
+    off->status = status;
+    off->note = note;
+    off->velocity = velocity;
+    return true;
+}
+
+// Add a channel message to the outbound queue, applying the overflow
+// policies described above. Interrupts must be off.
+//
+static void midi_queue_add(const uint8_t cin,
+                             const uint8_t data1,
+                             const uint8_t data2,
+                             const uint8_t data3,
+                             const uint8_t policy)
+{
+    // Older NoteOffs go first.
+    midi_queue_promote_pending();
+
+    if (policy != QUEUE_NORMAL) {
+        // Look for an event for the same controller that hasn't been sent
+        // yet and overwrite its value.
+        for (uint8_t i=0; i<s_midi_queue_perf; ++i) {
+            MIDI_EventPacket_t* event = &s_midi_queue[i];
+            if (event->Command == cin &&
+                event->Data1 == data1 &&
+                event->Data2 == data2) {
+                event->Data3 = data3;
+                return;
+            }
+        }
+    }
+
+    uint8_t limit = MIDI_QUEUE_SIZE;
+    if (policy == QUEUE_ECHO) {
+        limit = MIDI_QUEUE_SIZE * 3 / 4;
+    }
+    if (s_midi_queue_count < limit) {
+        midi_queue_push(MIDI_CABLE_PERFORMANCE, cin, data1, data2, data3);
+        return;
+    }
+
+    // No room.
+    if (cin == CIN_NOTE_OFF && midi_queue_defer(data1, data2, data3)) {
+        ++g_midi_tx_deferred;
+    } else {
+        ++g_midi_tx_dropped;
+    }
+}
+
+// Add a channel message to the outbound queue.
 //
-// NOTE: The endpoint can contain 64 bytes and each MIDI-USB message is 4
-// bytes giving us just enough space to fit in, for example, 16 keydown
-// messages.
+static void midi_queue_event(const uint8_t cin,
+                             const uint8_t data1,
+                             const uint8_t data2,
+                             const uint8_t data3,
+                             const uint8_t policy)
+{
+    uint8_t sreg = SREG;
+    cli();
+    midi_queue_add(cin, data1, data2, data3, policy);
+    SREG = sreg;
+}
+
+// Called when the main loop has used up its receive budget. Count the
+// event packets still waiting in the OUT endpoint, they will be read on a
+// later pass.
 //
-void midi_stream_note(const uint8_t pitch, const bool onoff)
+void midi_receive_deferred(void)
 {
-    // Each USB-MIDI endpoint can have up to 16 virtual cables each
-    // with 16 MIDI channels. Assign everything to cable 0 for now.
-    const uint8_t midi_virtual_cable = 0;
+    uint8_t sreg = SREG;
+    cli();
+    uint8_t prev_endpoint = Endpoint_GetCurrentEndpoint();
+    Endpoint_SelectEndpoint(MIDI_STREAM_OUT_EPNUM);
+    if (Endpoint_IsReadWriteAllowed()) {
+        g_midi_rx_deferred += Endpoint_BytesInEndpoint() /
+                              sizeof(MIDI_EventPacket_t);
+    }
+    Endpoint_SelectEndpoint(prev_endpoint);
+    SREG = sreg;
+}
 
-    // Check if the message should be a NoteOn or NoteOff event.
-    uint8_t command = ((onoff)? 0x90 : 0x80);
+// Write a single byte System Real Time event into the selected endpoint.
+//
+static void midi_write_realtime(const uint8_t status)
+{
+    Endpoint_Write_Byte((MIDI_CABLE_PERFORMANCE << 4) | 0xF);
+    Endpoint_Write_Byte(status);
+    Endpoint_Write_Byte(0);
+    Endpoint_Write_Byte(0);
+}
 
-    // Assemble a USB-MIDI event packet, remembering to mask off the values
-    // to the correct bit fields.
-    midi_event.CableNumber = midi_virtual_cable & 0x0f;  //0..15
-    midi_event.Command     = command >> 4;   // 0..15
-    midi_event.Data1       = command | (g_midi_channel & 0x0f);  // 0..15
-    midi_event.Data2       = pitch & 0x7f;   // 0..127
-    midi_event.Data3       = g_midi_velocity & 0x7f; // 0..127
+// Send a System Real Time message (clock, start, stop) as soon as
+// possible. Safe to call from an interrupt.
+//
+void midi_send_realtime(const uint8_t status)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured) return;
+
+    uint8_t sreg = SREG;
+    cli();
+    uint8_t prev_endpoint = Endpoint_GetCurrentEndpoint();
+    Endpoint_SelectEndpoint(MIDI_STREAM_IN_EPNUM);
+    if (s_midi_realtime_count == 0 && Endpoint_IsINReady()) {
+        midi_write_realtime(status);
+        Endpoint_ClearIN();
+        ++g_midi_tx_packets;
+    } else if (s_midi_realtime_count < MIDI_REALTIME_SIZE) {
+        s_midi_realtime[s_midi_realtime_count++] = status;
+    } else {
+        ++g_midi_tx_dropped;
+    }
+    Endpoint_SelectEndpoint(prev_endpoint);
+    SREG = sreg;
+}
 
-    MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+// Send queued events to the host, one USB packet per free endpoint bank.
+// Each packet is written with one stream write, and as the bank is known to
+// be empty the write never has to wait. If both banks are still full from
+// last time the events stay queued until the next call.
+//
+// This is called at the start of every USB frame, so events reach the host
+// a consistent time after they were generated rather than whenever the
+// main loop gets round to it. It can also be called from the main loop to
+// make room in the queue.
+//
+void midi_flush(void)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured) return;
+
+    uint8_t sreg = SREG;
+    cli();
+
+    // We may have interrupted the main loop part way through reading the
+    // OUT endpoint, so put the endpoint selection back when we're done.
+    uint8_t prev_endpoint = Endpoint_GetCurrentEndpoint();
+    Endpoint_SelectEndpoint(MIDI_STREAM_IN_EPNUM);
+
+    midi_queue_promote_pending();
+    while ((s_midi_realtime_count || s_midi_queue_count) &&
+           Endpoint_IsINReady()) {
+        // Real Time messages that missed their slot go first.
+        uint8_t room = EVENTS_PER_PACKET;
+        for (uint8_t i=0; i<s_midi_realtime_count; ++i) {
+            midi_write_realtime(s_midi_realtime[i]);
+            --room;
+        }
+        s_midi_realtime_count = 0;
+
+        uint8_t count = s_midi_queue_count;
+        if (count > room) {
+            count = room;
+        }
+
+        if (count) {
+            Endpoint_Write_Stream_LE(s_midi_queue,
+                                     count * sizeof(MIDI_EventPacket_t),
+                                     NO_STREAM_CALLBACK);
+        }
+        Endpoint_ClearIN();
+        ++g_midi_tx_packets;
+        if (count == 0) continue;
+
+        // Shuffle anything left over to the front of the queue.
+        s_midi_queue_count -= count;
+        s_midi_queue_perf = (s_midi_queue_perf > count) ?
+                            s_midi_queue_perf - count : 0;
+        memmove(&s_midi_queue[0], &s_midi_queue[count],
+                s_midi_queue_count * sizeof(MIDI_EventPacket_t));
+
+        // Record how long the oldest event waited, in milliseconds.
+        uint16_t now = clock_millis();
+        uint16_t wait = now - s_midi_queue_frame;
+        if (wait > g_midi_tx_peak_wait) {
+            g_midi_tx_peak_wait = (wait > 0xff) ? 0xff : wait;
+        }
+        s_midi_queue_frame = now;
+
+        g_midi_tx_last_batch = count;
+        if (count > g_midi_tx_peak_batch) {
+            g_midi_tx_peak_batch = count;
+        }
+        midi_queue_promote_pending();
+    }
+
+    Endpoint_SelectEndpoint(prev_endpoint);
+    SREG = sreg;
+}
+
+// Queue a MIDI note change event (note on or off) on our MIDI channel.
+// Returns false if it was a NoteOn for a note that was already on, in
+// which case nothing is sent.
+//
+//  pitch    Pitch of the note to turn on or off.
+//  onoff    True for a NoteOn, false for a NoteOff.
+//
+bool midi_stream_note(const uint8_t pitch, const bool onoff)
+{
+    return midi_stream_note_ch(g_midi_channel, pitch, onoff);
 }
 
-// Append a Control Change Event to the currently selected USB Endpoint. If
-// the endpoint is full it will be flushed.
+// Queue a Control Change event on our MIDI channel. If the controller
+// already has a value waiting to be sent it is replaced, and an analog CC
+// that already has this value isn't sent at all.
 //
 //  controller   Number of the controller to alter.
 //  value        Value to send to the CC.
 //
 void midi_stream_cc(const uint8_t controller, const uint8_t value)
 {
-    //  Assign this MIDI event to cable 0.
-    const uint8_t midi_virtual_cable = 0;
     const uint8_t command = 0xb0;  // the Channel Change command.
-
-    midi_event.CableNumber = midi_virtual_cable << 4;
-    midi_event.Command     = command >> 4;
-    midi_event.Data1       = command | (g_midi_channel & 0x0f); // 0..15
-    midi_event.Data2       = controller & 0x7f;   // 0..127
-    midi_event.Data3       = value & 0x7f;  // 0..127
-
-    MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+    uint8_t shadow = controller - MIDI_ANALOG_CC;
+    if (shadow < sizeof(s_midi_cc_shadow)) {
+        midi_shadow_check_channel();
+        if (s_midi_cc_shadow[shadow] == (value & 0x7f)) {
+            ++g_midi_tx_suppressed;
+            return;
+        }
+        s_midi_cc_shadow[shadow] = value & 0x7f;
+    }
+    midi_queue_event(command >> 4,
+                     command | (g_midi_channel & 0x0f), // 0..15
+                     controller & 0x7f,                 // 0..127
+                     value & 0x7f,                      // 0..127
+                     QUEUE_COALESCE);
 }
 
-// Used to send a note on a specific channel
-void midi_stream_note_ch(const uint8_t channel,
+// Used to send a note on a specific channel. Repeated NoteOns are only
+// suppressed on our own channel.
+bool midi_stream_note_ch(const uint8_t channel,
 						 const uint8_t pitch,
 						 const bool onoff)
 
 {
+	if (channel == g_midi_channel) {
+		midi_shadow_check_channel();
+		uint8_t* notes = &s_midi_sent_notes[(pitch & 0x7f) >> 3];
+		uint8_t mask = 1 << (pitch & 0x07);
+		if (onoff && (*notes & mask)) {
+			++g_midi_tx_suppressed;
+			return false;
+		}
+		if (onoff) {
+			*notes |= mask;
+		} else {
+			*notes &= ~mask;
+		}
+	}
+
 	// Check if the message should be a NoteOn or NoteOff event.
 	uint8_t command = ((onoff)? 0x90 : 0x80);
 
-	// Assemble a USB-MIDI event packet, remembering to mask off the values
-	// to the correct bit fields.
-	MIDI_EventPacket_t midi_event;
-	midi_event.CableNumber = 0x0;  // USB-MIDI virtual cable (0..15)
-	midi_event.Command     = command >> 4;   // 0..15
-	midi_event.Data1       = command | (channel & 0x0f);  // 0..15
-	midi_event.Data2       = pitch & 0x7f;   // 0..127
-	midi_event.Data3       = g_midi_velocity & 0x7f; // 0..127
-
-	MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+	midi_queue_event(command >> 4,                 // 0..15
+	                 command | (channel & 0x0f),   // 0..15
+	                 pitch & 0x7f,                 // 0..127
+	                 g_midi_velocity & 0x7f,       // 0..127
+	                 QUEUE_NORMAL);
+	return true;
 }
 
+// Used to send the LED echo CCs in Ableton mode. These are the first thing
+// to be dropped if the host isn't keeping up. Callers only send an echo
+// when the note it mirrors was actually sent.
 void midi_stream_raw_cc(const uint8_t channel,
 						const uint8_t cc,
 						const uint8_t value)
 {
 	const uint8_t command = 0xb0;  // the Channel Change command.
-	MIDI_EventPacket_t midi_event;
-	midi_event.CableNumber = 0x0;  // USB-MIDI virtual cable (0..15)
-	midi_event.Command     = command >> 4;
-	midi_event.Data1       = command | (channel & 0x0f); // 0..15
-	midi_event.Data2       = cc & 0x7f;   // 0..127
-	midi_event.Data3       = value & 0x7f;  // 0..127
-	MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+	midi_queue_event(command >> 4,
+	                 command | (channel & 0x0f),  // 0..15
+	                 cc & 0x7f,                   // 0..127
+	                 value & 0x7f,                // 0..127
+	                 QUEUE_ECHO);
 }
 
-void midi_stream_sysex (const uint8_t length, uint8_t* data)
+// Start writing a SysEx message. Only one message is written at a time,
+// and as a message has to be sent whole or not at all, one that arrives
+// while another is being written is dropped. SysEx input is left in the
+// endpoint while a message is being written, so command replies never
+// are. Interrupts must be off.
+//
+static bool midi_sysex_start(const uint16_t length,
+                             MidiByteSource source,
+                             const void* context)
+{
+    if (s_midi_sysex_source) {
+        g_midi_tx_dropped += (length + 2) / 3;
+        return false;
+    }
+    if (length == 0) return true;
+    s_midi_sysex_source = source;
+    s_midi_sysex_context = context;
+    s_midi_sysex_length = length;
+    s_midi_sysex_index = 0;
+    s_midi_sysex_cable = g_midi_sysex_cable;
+    s_midi_sysex_time = clock_millis();
+    s_midi_sysex_abort = false;
+    return true;
+}
+
+// Move as much of the SysEx message being written into the queue as its
+// cable has room for. This is called from the main loop rather than the
+// Start of Frame interrupt, as a byte source can be slow (an EEPROM read
+// waits for any write being programmed) and may read state that the main
+// loop is part way through changing. A host that takes nothing for
+// MIDI_SYSEX_TIMEOUT_MS has the rest of the message replaced by an F7, so
+// it's never left with an unterminated SysEx.
+//
+void midi_sysex_task(void)
 {
-    //  Assign this MIDI event to cable 0.
-    const uint8_t midi_virtual_cable = 0;
-	
-    //     0x2 = 2-byte System Common
-    //     0x3 = 3-byte System Common
     //     0x4 = 3-byte Sysex starts or continues
     //     0x5 = 1-byte System Common or Sysex ends
     //     0x6 = 2-byte Sysex ends
     //     0x7 = 3-byte Sysex ends
 
-    midi_event.CableNumber = midi_virtual_cable << 4;
-
-    uint8_t num = length;// + 1;
-    bool first = true;
-    while (num > 3) {
-        midi_event.Command     = 0x4;
-        if (first) {
-            first = false;
-            midi_event.Data1       = *data++;
-        } else {
-            midi_event.Data1       = *data++;
-        }
-        midi_event.Data2       = *data++;
-        midi_event.Data3       = *data++;
-        MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
-        num -= 3;
+    if (!s_midi_sysex_source) return;
+    uint8_t limit = MIDI_QUEUE_SIZE;
+    if (s_midi_sysex_cable != MIDI_CABLE_PERFORMANCE) {
+        limit -= QUEUE_PERF_RESERVE;
     }
-    if (num) {
-        midi_event.Command      = 0x5;
-        midi_event.Data1        = *data++;
-        midi_event.Data2        = 0;
-        midi_event.Data3        = 0;
-        if (num == 2) {
-            midi_event.Command  = 0x6;
-            midi_event.Data2    = *data++;
-        } else if (num == 3) {
-            if (first) {
-                midi_event.Command     = 0x3;
-            } else {
-                midi_event.Command  = 0x7;
+
+    for (;;) {
+        // Build the next packet with interrupts on.
+        uint16_t index = s_midi_sysex_index;
+        uint8_t command = 0x5;
+        uint8_t data[3] = {0xf7, 0, 0};
+        if (!s_midi_sysex_abort) {
+            uint16_t length = s_midi_sysex_length;
+            uint8_t num = (length - index > 3) ? 3 : length - index;
+            for (uint8_t i=0; i<num; ++i) {
+                data[i] = s_midi_sysex_source(index + i, s_midi_sysex_context);
             }
-            midi_event.Data2    = *data++;
-            midi_event.Data3    = *data++;
+            index += num;
+            command = (index < length) ? 0x4 : 0x4 + num;
+        }
+
+        // The Start of Frame interrupt may have queued deferred NoteOffs or
+        // cleared the queue in the meantime, so only now check for room.
+        uint8_t sreg = SREG;
+        cli();
+        if (!s_midi_sysex_source) {
+            SREG = sreg;
+            return;
+        }
+        bool room = s_midi_queue_count < limit;
+        if (room) {
+            midi_queue_push(s_midi_sysex_cable, command,
+                            data[0], data[1], data[2]);
+            s_midi_sysex_index = index;
+            s_midi_sysex_time = clock_millis();
+            if (s_midi_sysex_abort || index >= s_midi_sysex_length) {
+                s_midi_sysex_source = 0;
+            }
+        }
+        SREG = sreg;
+        if (!room) break;
+        if (!s_midi_sysex_source) return;
+    }
+
+    if (!s_midi_sysex_abort &&
+        (uint16_t)(clock_millis() - s_midi_sysex_time) > MIDI_SYSEX_TIMEOUT_MS) {
+        s_midi_sysex_abort = true;
+        g_midi_tx_dropped += (s_midi_sysex_length - s_midi_sysex_index + 2) / 3;
+    }
+}
+
+// Are there NoteOffs waiting for room in the queue?
+//
+bool midi_notes_pending(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    bool pending = s_midi_pending_count != 0;
+    SREG = sreg;
+    return pending;
+}
+
+// Is a SysEx message still being written?
+//
+bool midi_sysex_busy(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    bool busy = s_midi_sysex_source != 0;
+    SREG = sreg;
+    return busy;
+}
+
+// Stream a SysEx message of "length" bytes on g_midi_sysex_cable, pulling
+// each byte from "source" as it's needed and packing them straight into
+// USB-MIDI packets, so the message never has to exist in RAM. The message
+// is fed to the queue by midi_sysex_task() as the host takes it, so
+// "source" and "context" must stay valid until midi_sysex_busy() returns
+// false.
+//
+// Returns false if another message is still being written, in which case
+// this one is dropped.
+//
+bool midi_stream_sysex_source(const uint16_t length,
+                              MidiByteSource source,
+                              const void* context)
+{
+    uint8_t sreg = SREG;
+    cli();
+    bool started = midi_sysex_start(length, source, context);
+    SREG = sreg;
+    return started;
+}
+
+// Byte sources for midi_stream_sysex_source(), reading from RAM or program
+// memory.
+//
+uint8_t midi_source_ram(const uint16_t index, const void* context)
+{
+    return ((const uint8_t*)context)[index];
+}
+
+uint8_t midi_source_progmem(const uint16_t index, const void* context)
+{
+    return pgm_read_byte((const uint8_t*)context + index);
+}
+
+// Send a complete SysEx message from a RAM buffer. The message is copied,
+// so the buffer can be reused straight away.
+//
+void midi_stream_sysex (const uint8_t length, uint8_t* data)
+{
+    uint8_t sreg = SREG;
+    cli();
+    if (length > SYSEX_SCRATCH_SIZE || s_midi_sysex_source) {
+        g_midi_tx_dropped += (length + 2) / 3;
+    } else {
+        memcpy(g_sysex_scratch, data, length);
+        midi_sysex_start(length, midi_source_ram, g_sysex_scratch);
+    }
+    SREG = sreg;
+}
+
+// MIDI note state ------------------------------------------------------------
+
+// Find a note's slot in the velocity cache, or 0xff if it has none.
+//
+static uint8_t midi_note_cache_slot(const uint8_t note)
+{
+    uint8_t slot = note - MIDI_BASE_NOTE;
+    if (slot < NOTE_CACHE_BANKS) return slot;
+    slot = note - MIDI_DIGITAL_NOTE;
+    if (slot < 4) return NOTE_CACHE_BANKS + slot;
+    return 0xff;
+}
+
+// Record the most recent velocity for a note, zero being NoteOff.
+//
+void midi_note_set(uint8_t note, const uint8_t velocity)
+{
+    note &= 0x7f;
+    uint8_t bit = 1 << (note & 7);
+    if (velocity) {
+        s_midi_note_on[note >> 3] |= bit;
+    } else {
+        s_midi_note_on[note >> 3] &= ~bit;
+    }
+
+    uint8_t slot = midi_note_cache_slot(note);
+    if (slot == 0xff) return;
+    uint8_t* cell = &s_midi_note_velocity[slot >> 1];
+    uint8_t nibble = (velocity >> 3) & 0x0f;
+    if (slot & 1) {
+        *cell = (*cell & 0x0f) | (nibble << 4);
+    } else {
+        *cell = (*cell & 0xf0) | nibble;
+    }
+}
+
+// Is the note on?
+//
+bool midi_note_is_on(const uint8_t note)
+{
+    return (s_midi_note_on[(note >> 3) & 0x0f] & (1 << (note & 7))) != 0;
+}
+
+// Return the velocity of a note, or zero if it's off. Cached velocities
+// are only kept to the nearest 8, so the top of that step is returned, and
+// notes without a cache slot read as full velocity.
+//
+uint8_t midi_note_velocity(const uint8_t note)
+{
+    if (!midi_note_is_on(note)) return 0;
+    uint8_t slot = midi_note_cache_slot(note);
+    if (slot == 0xff) return 127;
+    uint8_t cell = s_midi_note_velocity[slot >> 1];
+    if (slot & 1) {
+        cell >>= 4;
+    }
+    return ((cell & 0x0f) << 3) | 0x07;
+}
+
+// Return the on/off bits of the 16 notes starting at first_note, bit 0
+// being first_note, so a whole bank can be tested at once.
+//
+uint16_t midi_note_bits(const uint8_t first_note)
+{
+    uint8_t index = first_note >> 3;
+    uint32_t bits = 0;
+    for (uint8_t i=3; i; --i) {
+        bits <<= 8;
+        if (index + i - 1 < sizeof(s_midi_note_on)) {
+            bits |= s_midi_note_on[index + i - 1];
         }
-        MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
     }
+    return (uint16_t)(bits >> (first_note & 7));
+}
+
+// Convert 16 bits of note state, as returned by midi_note_bits(), into key
+// LED bits. The notes run from the bottom row of the keypad up, so this
+// swaps the order of the rows, the same mapping as kNoteMap.
+//
+uint16_t midi_note_bits_to_keys(const uint16_t bits)
+{
+    return (bits << 12) | ((bits << 4) & 0x0f00) |
+           ((bits >> 4) & 0x00f0) | (bits >> 12);
 }
 
 // Convert a note number (relative to the basenote) to an LED number,
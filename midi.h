@@ -28,6 +28,7 @@
 #include <LUFA/Drivers/USB/USB.h>
 #include <LUFA/Drivers/USB/Class/MIDI.h>
 #include "constants.h"
+#include "usb_descriptors.h"
 
 // MIDI types ------------------------------------------------------------------
 
@@ -48,15 +49,32 @@ extern USB_ClassInfo_MIDI_Device_t* g_midi_interface_info;
 extern uint8_t g_midi_channel;
 extern uint8_t g_midi_velocity;
 
-// a copy of the most recent velocity for each MIDI note.
-extern uint8_t g_midi_note_state[MIDI_MAX_NOTES];
+extern uint16_t g_midi_tx_dropped;
+extern uint16_t g_midi_tx_deferred;
+extern uint16_t g_midi_tx_packets;
+extern uint8_t g_midi_tx_last_batch;
+extern uint8_t g_midi_tx_peak_batch;
+extern uint8_t g_midi_tx_peak_wait;
+extern uint16_t g_midi_tx_suppressed;
+extern uint16_t g_midi_rx_deferred;
+
+extern uint8_t g_midi_sysex_cable;
 
 // MIDI function prototypes ----------------------------------------------------
 
 void midi_setup(void);
-void midi_stream_note(const uint8_t pitch, const bool onoff);
-void midi_stream_note_ch(const uint8_t channel, const uint8_t note, const bool onoff);
+void midi_clear_queue(void);
+void midi_flush(void);
+void midi_receive_deferred(void);
+void midi_send_realtime(const uint8_t status);
+bool midi_stream_note(const uint8_t pitch, const bool onoff);
+bool midi_stream_note_ch(const uint8_t channel, const uint8_t note, const bool onoff);
 void midi_stream_cc(const uint8_t controller, const uint8_t value);
+void midi_note_set(uint8_t note, const uint8_t velocity);
+bool midi_note_is_on(const uint8_t note);
+uint8_t midi_note_velocity(const uint8_t note);
+uint16_t midi_note_bits(const uint8_t first_note);
+uint16_t midi_note_bits_to_keys(const uint16_t bits);
 uint8_t midi_note_to_key(const uint8_t notenum);
 uint8_t midi_key_to_note(const uint8_t keynum);
 uint8_t midi_fourbanks_key_to_note(const uint8_t keynum);
@@ -66,4 +84,15 @@ void midi_stream_raw_cc(const uint8_t channel,
 						const uint8_t value);
 void midi_stream_sysex (const uint8_t length, uint8_t* data);
 
+// Streaming SysEx, the source returns the message byte at "index".
+typedef uint8_t (*MidiByteSource)(const uint16_t index, const void* context);
+bool midi_stream_sysex_source(const uint16_t length,
+                              MidiByteSource source,
+                              const void* context);
+void midi_sysex_task(void);
+bool midi_notes_pending(void);
+bool midi_sysex_busy(void);
+uint8_t midi_source_ram(const uint16_t index, const void* context);
+uint8_t midi_source_progmem(const uint16_t index, const void* context);
+
 #endif // _MIDI_H_INCLUDED
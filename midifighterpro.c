@@ -24,6 +24,7 @@
 
 #include "key.h"
 #include "led.h"
+#include "clock.h"
 #include "spi.h"
 #include "menu.h"
 #include "midi.h"
@@ -36,6 +37,7 @@
 #include "sysex.h"
 #include "config.h"
 #include "combo.h"
+#include "preset.h"
 #include "jumptoboot.h"
 
 // Forward Declarations --------------------------------------------------------
@@ -51,6 +53,28 @@ void EVENT_USB_Device_UnhandledControlRequest(void);
 
 static bool main_watchdog_flag = false;
 
+// Set when the host should be sent a state snapshot at the next
+// opportunity.
+static volatile bool s_snapshot_pending = false;
+
+// Set by EVENT_USB_Device_ConfigurationChanged() to the LEDs that show how
+// the configuration went, the main loop shows them for USB_CONFIG_SHOW_MS.
+#define USB_CONFIG_SHOW_MS 40
+static volatile uint16_t s_usb_config_leds = 0;
+static bool s_usb_config_showing = false;
+static uint16_t s_usb_config_time;
+
+// A USB-MIDI packet read from the OUT endpoint but not handled yet, as it
+// is SysEx and the reply to the last request is still going out.
+static MIDI_EventPacket_t s_input_event;
+static volatile bool s_input_held = false;
+
+// Keys that were held through a preset change. They stay silent until they
+// are released, so a note is never ended with other settings than it was
+// started with.
+static uint16_t s_preset_mute = 0;
+static uint8_t s_preset_mute_exp = 0;
+
 // Helper functions ------------------------------------------------------------
 
 uint8_t remap(uint8_t value, uint8_t from, uint8_t to, uint8_t lo, uint8_t hi)
@@ -98,25 +122,39 @@ void EVENT_USB_Device_Disconnect(void)
 
 // Device has enumerated. Set up the Endpoints.
 //
+// NOTE: This runs in the USB interrupt, so it only does the USB side of
+// things. Showing the result on the LEDs and starting the watchdog are left
+// to usb_configured_task() in the main loop.
+//
 void EVENT_USB_Device_ConfigurationChanged(void)
 {
-    // Indicate that USB is now ready to use (followed by a short delay so
-    // you can actually see it flash).
-    led_set_state(0x0004);
+    // Anything queued before now was meant for a previous configuration.
+    midi_clear_queue();
+    s_input_held = false;
 
     // Allow the LUFA MIDI Class drivers to configure the USB endpoints.
+    uint16_t leds = 0x0004;
     if (!MIDI_Device_ConfigureEndpoints(g_midi_interface_info)) {
         // Setting up the endpoints failed, display the error state.
-        led_set_state(0x0008);
+        leds = 0x0008;
     }
 
-    // Success. Add a short delay so the final USB state LEDs can be seen
-    // before the MIDI task takes over the LEDs.
-    _delay_ms(40);
-    led_set_state(0x0000);
-	// Now we can enable the watchdog timer
-	MCUSR &= ~(1 << WDRF);  // clear the watchdog reset flag
-	wdt_enable(WDTO_120MS);
+    // Start of Frame events send our MIDI.
+    USB_Device_EnableSOFEvents();
+
+    // The host knows nothing about our controls yet, send it a snapshot
+    // from the main loop once it's running.
+    s_snapshot_pending = true;
+
+    s_usb_config_leds = leds;
+}
+
+// The host has started a new 1ms USB frame. Hand any queued MIDI to the IN
+// endpoint so it goes out in this frame.
+//
+void EVENT_USB_Device_StartOfFrame(void)
+{
+    midi_flush();
 }
 
 // Any other USB control command that we don't recognize is handled here.
@@ -167,6 +205,255 @@ void EVENT_USB_Device_UnhandledControlRequest(void)
 // }
 
 
+// State snapshot --------------------------------------------------------------
+
+// The snapshot tells the host everything it would otherwise only learn by
+// waiting for someone to move each control. It's packed 8-to-7 into a
+// single SysEx, small enough to go to the host in one USB frame:
+//
+//   byte 0          selected bank
+//   byte 1          fourbanks mode
+//   bytes 2-3       held keys, low byte first
+//   byte 4          held expansion keys
+//   NUM_ANALOG      current CC A value of each analog control
+//   2 * NUM_ANALOG  raw 10-bit ADC reading of each control, low byte first
+//
+#define SNAPSHOT_LENGTH (5 + 3 * NUM_ANALOG)
+
+static uint8_t snapshot_byte(const uint16_t index, const void* context)
+{
+    switch (index) {
+    case 0: return g_key_bank_selected;
+    case 1: return g_key_fourbanks_mode;
+    case 2: return g_key_state & 0xff;
+    case 3: return g_key_state >> 8;
+    case 4: return g_exp_key_state;
+    }
+    uint8_t i = index - 5;
+    if (i < NUM_ANALOG) {
+        // The same mapping the analog controls use for CC A, with a
+        // dead zone of 3 at either end.
+        return remap(g_exp_analog_prev[i] >> 3, 3, 124, 0, 127);
+    }
+    i -= NUM_ANALOG;
+    uint16_t adc = g_exp_analog_prev[i >> 1];
+    return (i & 1) ? adc >> 8 : adc & 0xff;
+}
+
+// Send the state snapshot now.
+//
+void send_state_snapshot(void)
+{
+    s_snapshot_pending = false;
+    const uint8_t header[] = {0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+                              SYSEX_COMMAND_SNAPSHOT, 0x01};
+    sysex_stream_packed(header, sizeof(header), SNAPSHOT_LENGTH,
+                        snapshot_byte, 0);
+}
+
+// Send a NoteOff for every held key, as the key would on release.
+//
+static void release_held_keys(void)
+{
+    uint16_t held = g_key_state;
+    uint8_t first = 0;
+    if (g_key_fourbanks_mode == FOURBANKS_INTERNAL) {
+        if (held & (1 << g_key_bank_selected)) {
+            midi_stream_note(g_key_bank_selected, false);
+        }
+        first = 4;
+    }
+    for (uint8_t i=first; i<16; ++i) {
+        if (held & (1 << i)) {
+            uint8_t note = midi_fourbanks_key_to_note(i);
+            if (midi_stream_note(note, false) && g_device_mode == ABLETON) {
+                midi_stream_raw_cc(g_midi_channel+1, note, 0);
+            }
+        }
+    }
+    if (g_key_fourbanks_mode == FOURBANKS_EXTERNAL) {
+        if (g_exp_key_state & (1 << g_key_bank_selected)) {
+            midi_stream_note(g_key_bank_selected, false);
+        }
+    } else {
+        for (uint8_t i=0; i<4; ++i) {
+            if (g_exp_key_state & (1 << i)) {
+                midi_stream_note(MIDI_DIGITAL_NOTE + i, false);
+            }
+        }
+    }
+    s_preset_mute = g_key_state;
+    s_preset_mute_exp = g_exp_key_state;
+}
+
+// Switch to another preset slot. Held keys are released first, on the
+// channel and mapping they were pressed with. Selecting the preset that is
+// already active does nothing, so held notes carry on.
+//
+// While older NoteOffs are still waiting for room in the queue the switch
+// is refused. The pending store then has room for every release on the
+// old channel, so none can be lost to the new settings.
+//
+void select_preset(const uint8_t preset)
+{
+    if (preset >= PRESET_COUNT || preset == g_preset_active) return;
+    if (midi_notes_pending()) return;
+    release_held_keys();
+    preset_select(preset);
+    led_flash_start();
+}
+
+// The main loop half of EVENT_USB_Device_ConfigurationChanged(). Indicate
+// that USB is now ready to use, holding the LEDs for a short time so you
+// can actually see it flash, then hand the LEDs back to the MIDI task and
+// enable the watchdog. Returns true while the LEDs are being held.
+//
+static bool usb_configured_task(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t leds = s_usb_config_leds;
+    s_usb_config_leds = 0;
+    SREG = sreg;
+
+    if (leds) {
+        led_set_state(leds);
+        s_usb_config_time = clock_millis();
+        s_usb_config_showing = true;
+    }
+    if (!s_usb_config_showing) return false;
+    if ((uint16_t)(clock_millis() - s_usb_config_time) < USB_CONFIG_SHOW_MS) {
+        return true;
+    }
+    s_usb_config_showing = false;
+    led_set_state(0x0000);
+
+	// Now we can enable the watchdog timer
+	MCUSR &= ~(1 << WDRF);  // clear the watchdog reset flag
+	wdt_enable(WDTO_120MS);
+    return false;
+}
+
+// Return the bits of the 16 notes from first_note that are on and lit at
+// this point of the blink cycle. Velocities are only looked up for notes
+// that are on, and not at all when nothing is blinking.
+//
+static uint16_t lit_notes(const uint8_t first_note, const uint8_t blink)
+{
+    uint16_t bits = midi_note_bits(first_note);
+    if (blink == 0xff) return bits;
+    uint16_t bit = 0x0001;
+    for (uint8_t i=0; i<16; ++i) {
+        if ((bits & bit) &&
+            !led_velocity_lit(blink, midi_note_velocity(first_note + i))) {
+            bits &= ~bit;
+        }
+        bit <<= 1;
+    }
+    return bits;
+}
+
+// MIDI input handlers --------------------------------------------------------
+
+// Notes, CCs and clock are only accepted on the performance cable, SysEx is
+// accepted on either.
+
+// Is this channel message on the performance cable and our MIDI channel?
+//
+static bool input_is_ours(const MIDI_EventPacket_t* event)
+{
+    return event->CableNumber == MIDI_CABLE_PERFORMANCE &&
+           (event->Data1 & 0x0f) == g_midi_channel;
+}
+
+// SysEx starts or continues with 3 bytes, or ends with 1, 2 or 3 bytes.
+// The bytes go straight to the SysEx parser, which spots the 0xF7 itself.
+// A 1-byte System Common message uses the same code but we have no use for
+// those, and the parser ignores anything outside a message.
+//
+static void input_sysex(const MIDI_EventPacket_t* event)
+{
+    uint8_t count = (event->Command == 0x4) ? 3 : event->Command - 0x4;
+    sysex_receive(event->Data1, event->CableNumber);
+    if (count > 1) sysex_receive(event->Data2, event->CableNumber);
+    if (count > 2) sysex_receive(event->Data3, event->CableNumber);
+}
+
+// A NoteOff event, so record a zero in the MIDI keystate. Yes, a noteoff
+// can have a "velocity", but we're relying on the keystate to be zero when
+// we have a noteoff, otherwise the LEDs won't match the state when we come
+// to calculate them.
+//
+static void input_note_off(const MIDI_EventPacket_t* event)
+{
+    if (!input_is_ours(event)) return;
+    midi_note_set(event->Data2, 0);
+}
+
+// A NoteOn event was found, so update the MIDI keystate with the note
+// velocity (which may be zero).
+//
+static void input_note_on(const MIDI_EventPacket_t* event)
+{
+    if (!input_is_ours(event)) return;
+    midi_note_set(event->Data2, event->Data3);
+}
+
+// A Control Change. If it's the controller driving the level meter,
+// record the new level.
+//
+static void input_control_change(const MIDI_EventPacket_t* event)
+{
+    if (!input_is_ours(event)) return;
+    if (event->Data2 == g_led_meter_cc) {
+        g_led_meter_level = event->Data3;
+    }
+}
+
+// A single byte message, which for us means System Real Time.
+//
+static void input_realtime(const MIDI_EventPacket_t* event)
+{
+    if (event->CableNumber != MIDI_CABLE_PERFORMANCE) return;
+    // In master clock mode we are the tempo source, ignore the host's
+    // clock.
+    if (g_clock_master) return;
+    if (event->Data1 == 0xF8) {
+        // Clock event, timestamp it for the beat tracker.
+        clock_midi_tick();
+    } else if (event->Data1 == 0xFA) {
+        // Song Start, the next tick starts the bar.
+        clock_midi_start();
+    } else if (event->Data1 == 0xFC) {
+        // Song Stop event, rewind the beat tracker.
+        clock_midi_stop();
+    }
+}
+
+// Handlers indexed by the lower 4-bits (".Command") of the USB-MIDI event
+// packet, the Code Index Number, which tells us what kind of data it
+// contains. Zero entries are ignored.
+//
+typedef void (*MidiInputFn)(const MIDI_EventPacket_t* event);
+static const MidiInputFn kMidiInput[16] PROGMEM = {
+    0,                     // 0x0 = Reserved for Misc
+    0,                     // 0x1 = Reserved for Cable events
+    0,                     // 0x2 = 2-byte System Common
+    0,                     // 0x3 = 3-byte System Common
+    input_sysex,           // 0x4 = 3-byte Sysex starts or continues
+    input_sysex,           // 0x5 = 1-byte System Common or Sysex ends
+    input_sysex,           // 0x6 = 2-byte Sysex ends
+    input_sysex,           // 0x7 = 3-byte Sysex ends
+    input_note_off,        // 0x8 = Note Off
+    input_note_on,         // 0x9 = Note On
+    0,                     // 0xA = Poly KeyPress
+    input_control_change,  // 0xB = Control Change (CC)
+    0,                     // 0xC = Program Change
+    0,                     // 0xD = Channel Pressure
+    0,                     // 0xE = PitchBend Change
+    input_realtime,        // 0xF = 1-byte message
+};
+
 // The MIDI processing task.
 //
 // Read the buttons and expansion ports to generate MIDI notes. This routine
@@ -287,109 +574,41 @@ void Midifighter_Task(void)
     // keypad.
 
 
-	SysEx_t sysEx;
-	uint8_t index = 0;
-
-
     // INPUT MIDI from USB -----------------------------------------------------
 
     // If there is data in the Endpoint for us to read, get a USB-MIDI
-    // packet to process. Endpoint_IsReadWriteAllowed() returns true if
-    // there is data remaining inside an OUT endpoint or if an IN endpoint
-    // has space left to fill. The same function doing two jobs, confusing
-    // but there you are.
-    MIDI_EventPacket_t input_event;
-    while (MIDI_Device_ReceiveEventPacket(g_midi_interface_info,
-                                          &input_event)) {
-        // Assuming all virtual MIDI cables are intended for us, ensure that
-        // this event is being sent on our current MIDI channel.
-        //
-        // The lower 4-bits (".Command") of the USB_MIDI event packet tells
-        // us what kind of data it contains, and whether to expect more data
-        // in the same message. Commands are:
-        //     0x0 = Reserved for Misc
-        //     0x1 = Reserved for Cable events
-        //     0x2 = 2-byte System Common
-        //     0x3 = 3-byte System Common
-        //     0x4 = 3-byte Sysex starts or continues
-        //     0x5 = 1-byte System Common or Sysex ends
-        //     0x6 = 2-byte Sysex ends
-        //     0x7 = 3-byte Sysex ends
-        //     0x8 = Note On
-        //     0x9 = Note Off
-        //     0xA = Poly KeyPress
-        //     0xB = Control Change (CC)
-        //     0xC = Program Change
-        //     0xD = Channel Pressure
-        //     0xE = PitchBend Change
-        //     0xF = 1-byte message
-
-        // System Real Time events don't have a channel, so we check for
-        // them first.
-        if (input_event.Command == 0xF) {
-            if (input_event.Data1 == 0xF8) {
-                // Clock event, increment the counter.
-                g_led_groundfx_counter++;
-            } else if (input_event.Data1 == 0xFA) {
-                // Song Start, reset the counter.
-                g_led_groundfx_counter = 0;
-            } else if (input_event.Data1 == 0xFC) {
-                // Song Stop event, reset the counter.
-                g_led_groundfx_counter = 0;
-            }
+    // packet to process and hand it to the handler for its Code Index
+    // Number. Only MIDI_INPUT_BUDGET packets are read each pass, anything
+    // more waits in the endpoint until next time.
+    //
+    // Only one SysEx reply can be written at a time, so while one is going
+    // out SysEx input is held back, along with everything behind it, until
+    // it has finished. A host sending requests back to back gets every
+    // reply, in order, just a little later.
+    uint8_t budget = MIDI_INPUT_BUDGET;
+    for (;;) {
+        if (!s_input_held &&
+            !MIDI_Device_ReceiveEventPacket(g_midi_interface_info,
+                                            &s_input_event)) {
+            break;
         }
-		else if (input_event.Command == 0x4) { // Start or continue 3 bytes
-			SYSEX_READ(1);
-			SYSEX_READ(2);
-			SYSEX_READ(3);
-		}
-		else if (input_event.Command == 0x5) { // End  1 byte
-			SYSEX_READ(1);
-			SYSEX_END();
-		}
-		else if (input_event.Command == 0x6) { // End 2 bytes
-			SYSEX_READ(1);
-			SYSEX_READ(2);
-			SYSEX_END();
-		}
-		else if (input_event.Command == 0x7) { // End 3 bytes
-			SYSEX_READ(1);
-			SYSEX_READ(2);
-			SYSEX_READ(3);
-			SYSEX_END();
-		}
-		else {
-			// Now we can check that the MIDI channel is the one we're payin
-			// attention to before parsing the event.
-			uint8_t channel = input_event.Data1 & 0x0f;
-			if (channel == g_midi_channel) {
-				// Check to see if we have a NoteOn or NoteOff event.
-				switch (input_event.Command) {
-				case 0x9 : {
-						// A NoteOn event was found, so update the MIDI
-						// keystate with the note velocity (which may be
-						// zero).
-						uint8_t note = input_event.Data2;
-						uint8_t velocity = input_event.Data3;
-						// record the note velocity in the MIDI note state
-						g_midi_note_state[note] = velocity;
-					}
-					break;
-				case 0x8 : {
-						// A NoteOff event, so record a zero in the MIDI
-						// keystate. Yes, a noteoff can have a "velocity",
-						// but we're relying on the keystate to be zero when
-						// we have a noteoff, otherwise the LEDs won't match
-						// the state when we come to calculate them.
-						uint8_t note = input_event.Data2;
-						// record a zero note velocity in the MIDI note state
-						g_midi_note_state[note] = 0;
-					}
-					break;
-				}  // end switch on command
-			} // end channel test
-		}
-    } // end while
+        s_input_held = false;
+        if (s_input_event.Command >= 0x4 && s_input_event.Command <= 0x7 &&
+            midi_sysex_busy()) {
+            s_input_held = true;
+            midi_receive_deferred();
+            break;
+        }
+        MidiInputFn handler =
+            (MidiInputFn)pgm_read_word(&kMidiInput[s_input_event.Command]);
+        if (handler) {
+            handler(&s_input_event);
+        }
+        if (--budget == 0) {
+            midi_receive_deferred();
+            break;
+        }
+    }
 
 
     // OUTPUT events from the EXPANSION ports ----------------------------------
@@ -399,8 +618,14 @@ void Midifighter_Task(void)
     exp_key_read();  // scan the debounce buffer.
     exp_key_calc();  // update the keyup/keydown variables.
 
+    // Ports held through a preset change stay silent until released.
+    if (s_preset_mute_exp) {
+        g_exp_key_down &= ~s_preset_mute_exp;
+        g_exp_key_up &= ~s_preset_mute_exp;
+        s_preset_mute_exp &= g_exp_key_state;
+    }
+
     // Expansion port pins generate the MIDI notes 4 to 7.
-    const uint8_t MIDI_DIGITAL_NOTE = 4;  // lowest digital note.
 
     // NOTE: enabling fourbanks external mode turns off digital note generation.
     if (g_key_fourbanks_mode != FOURBANKS_EXTERNAL) {
@@ -490,7 +715,6 @@ void Midifighter_Task(void)
             const uint8_t NOTEON_LOW = 3;
             const uint8_t NOTEON_HIGH = 127 - NOTEON_LOW;
             const uint8_t MIDI_ANALOG_NOTE = 100;
-            const uint8_t MIDI_ANALOG_CC = 16;
             uint8_t cc_a = MIDI_ANALOG_CC + 2*i;
             uint8_t cc_b = MIDI_ANALOG_CC + 2*i + 1;
             uint8_t note_a = MIDI_ANALOG_NOTE + 2*i;
@@ -515,18 +739,13 @@ void Midifighter_Task(void)
 				if (g_device_mode == TRAKTOR)
 				{
 					// 2. If the value is in the range 50%-100%, output the
-					// second CC range.
-					static uint8_t second_cc_value = 0;
+					// second CC range, otherwise hold it at zero. Repeats
+					// of the same value are suppressed by midi_stream_cc(),
+					// so the zero only goes out once per channel.
 					if (value >= 64) {
-						second_cc_value = remap(value, 64,NOTEON_HIGH, 0,105);
-						midi_stream_cc(cc_b, second_cc_value);
+						midi_stream_cc(cc_b, remap(value, 64,NOTEON_HIGH, 0,105));
 					} else {
-						// Make sure we zero the second CC value when we
-						// enter the lower range.
-						if (second_cc_value > 0) {
-							second_cc_value = 0;
-							midi_stream_cc(cc_b, second_cc_value);
-						}
+						midi_stream_cc(cc_b, 0);
 					}
 				}				
             }
@@ -542,16 +761,16 @@ void Midifighter_Task(void)
 			{
 				if (value <= NOTEON_LOW && prev_value > NOTEON_LOW) {
 					midi_stream_note(note_a, true);
-					g_midi_note_state[note_a] = g_midi_velocity;
+					midi_note_set(note_a, g_midi_velocity);
 				} else if (value > NOTEON_LOW && prev_value <= NOTEON_LOW) {
 					midi_stream_note(note_a, false);
-					g_midi_note_state[note_a] = 0;
+					midi_note_set(note_a, 0);
 				} else if (value >= NOTEON_HIGH && prev_value < NOTEON_HIGH) {
 					midi_stream_note(note_b, true);
-					g_midi_note_state[note_b] = g_midi_velocity;
+					midi_note_set(note_b, g_midi_velocity);
 				} else if (value < NOTEON_HIGH && prev_value >= NOTEON_HIGH) {
 					midi_stream_note(note_b, false);
-					g_midi_note_state[note_b] = 0;
+					midi_note_set(note_b, 0);
 				}
 			}			
 
@@ -562,9 +781,52 @@ void Midifighter_Task(void)
 
     // OUTPUT key presses ------------------------------------------------------
 
+    g_key_timed = g_clock_tap_key;  // Have the scan interrupt time the tap key.
     key_read();  // Read the debounce buffer to generate a keystate.
     key_calc();  // Use the new keystate to update keydown/keyup state.
 
+    // In master clock mode the tap key drives the tempo engine and doesn't
+    // send MIDI or trigger combos.
+    if (g_clock_master) {
+        uint16_t tap_bit = 1 << g_clock_tap_key;
+        if (g_key_down & tap_bit) {
+            clock_tap_press(key_timed_down());
+        }
+        if (g_key_up & tap_bit) {
+            clock_tap_release(key_timed_up());
+        }
+        g_key_down &= ~tap_bit;
+        g_key_up &= ~tap_bit;
+    }
+    clock_master_task();
+
+    // Keys held through a preset change stay silent until released.
+    if (s_preset_mute) {
+        g_key_down &= ~s_preset_mute;
+        g_key_up &= ~s_preset_mute;
+        s_preset_mute &= g_key_state;
+    }
+
+    // Preset selection: hold the top left and top right keys and press a
+    // key on the bottom row to switch to preset 1 to 4. It's a combo, so
+    // it's only on when combos are, and in Fourbanks Internal mode the top
+    // row selects banks so it's off altogether.
+    if (g_combos_enable &&
+        g_key_fourbanks_mode != FOURBANKS_INTERNAL &&
+        (g_key_state & PRESET_COMBO_HOLD) == PRESET_COMBO_HOLD &&
+        (g_key_down & PRESET_COMBO_SELECT)) {
+        uint16_t preset_bit = 0x1000;
+        uint8_t preset = 0;
+        while (!(g_key_down & preset_bit)) {
+            preset_bit <<= 1;
+            ++preset;
+        }
+        select_preset(preset);
+        // The selecting key is part of the combo, it never plays.
+        s_preset_mute |= preset_bit;
+        g_key_down &= ~s_preset_mute;
+    }
+
     // Setup the variables for Bank output based on the Fourbanks mode.
     uint16_t bank_keydown = 0;
     uint16_t bank_keyup = 0;
@@ -643,6 +905,7 @@ void Midifighter_Task(void)
         // NoteOn for the new bank every time it's pressed.
         midi_stream_note(new_bank, true);
         g_key_bank_selected = new_bank;
+        eeprom_journal_set(JOURNAL_BANK, new_bank);
     }
 
     if (bank_keyup & 0x000f) {
@@ -660,17 +923,17 @@ void Midifighter_Task(void)
         if (keydown & bit) {
             // There's a key down, put a NoteOn event into the stream.
             uint8_t note = midi_fourbanks_key_to_note(i + keyoffset);
-			if (g_device_mode == ABLETON)
+            // In Ableton mode, echo the note as a CC for the LEDs, but only
+            // if the note itself wasn't a repeat.
+            if (midi_stream_note(note, true) && g_device_mode == ABLETON)
 			{
 				midi_stream_raw_cc(g_midi_channel+1,note,127);			
 			}			
-            midi_stream_note(note, true);
         }
         if (keyup & bit) {
             // There's a key up, put a NoteOff event onto the stream.
             uint8_t note = midi_fourbanks_key_to_note(i + keyoffset);
-            midi_stream_note(note, false);
-			if (g_device_mode == ABLETON)
+            if (midi_stream_note(note, false) && g_device_mode == ABLETON)
 			{
 				midi_stream_raw_cc(g_midi_channel+1,note,0);			
 			}			
@@ -719,27 +982,38 @@ void Midifighter_Task(void)
 		}
 	}
 
-    // Finished generating MIDI events, flush the endpoints.
-    MIDI_Device_Flush(g_midi_interface_info);
+    // If the host has just configured us, bring it up to date as soon as
+    // any reply still going out has finished.
+    if (s_snapshot_pending && !midi_sysex_busy()) {
+        send_state_snapshot();
+    }
+
+    // Feed any SysEx being written into the queue.
+    midi_sysex_task();
+
+    // Finished generating MIDI events. They are sent from the Start of
+    // Frame interrupt, see EVENT_USB_Device_StartOfFrame().
 
 
     // Update the LEDs ---------------------------------------------------------
 
     uint16_t leds = 0x0000;
 
+    // Read the smoothed position in the bar from the beat tracker once, and
+    // use it for all the tempo synced lights.
+    uint8_t bar_tick = clock_bar_tick();
+
+    // Work out which velocity ranges are lit at this point in the beat, so
+    // that host-selected blink states animate without any more MIDI.
+    uint8_t blink = led_blink_mask(bar_tick);
+
     if (g_key_fourbanks_mode == FOURBANKS_OFF) {
 
         // Normal display
         // --------------
-        // Update the 16 LEDs with the current midi state. Loop over the
-        // MIDI keystate array and set an LED bit if that MIDI note has a
-        // velocity greater than zero.
-        uint8_t basenote = MIDI_BASE_NOTE;
-        for (uint8_t i=basenote; i<basenote + 16; ++i) {
-            if (g_midi_note_state[i] > 0) {
-                leds |= 1 << midi_note_to_key(i);
-            }
-        }
+        // Update the 16 LEDs with the current midi state, lighting the
+        // keys whose notes are on and lit at this point of the blink cycle.
+        leds |= midi_note_bits_to_keys(lit_notes(MIDI_BASE_NOTE, blink));
 
         // If keypress lights are enabled, illuminate the LED of keys
         // currently activated.
@@ -748,14 +1022,7 @@ void Midifighter_Task(void)
         }
 
         // update the external key LEDs.
-        uint8_t key_leds = 0;
-        uint8_t key_bit = 0x01;
-        for (uint8_t i=0; i<4; ++i) {
-            if (g_midi_note_state[MIDI_DIGITAL_NOTE + i] > 0) {
-                key_leds |= key_bit;
-            }
-            key_bit <<= 1;
-        }
+        uint8_t key_leds = lit_notes(MIDI_DIGITAL_NOTE, blink) & 0x0f;
 		
 		//If exp_keypress leds are enabled, illuminate the LED of keys 
 		//currently activated. Warning this bool is hard coded as true
@@ -778,11 +1045,7 @@ void Midifighter_Task(void)
         // Update the bottom 12 LEDs with the MIDI state of the selected
         // bank.
         uint8_t basenote = MIDI_BASE_NOTE + (g_key_bank_selected * 12);
-        for (uint8_t i=basenote; i<basenote + 12; ++i) {
-            if (g_midi_note_state[i] > 0) {
-                leds |= 1 << midi_fourbanks_note_to_key(i);
-            }
-        }
+        leds |= midi_note_bits_to_keys(lit_notes(basenote, blink) & 0x0fff);
 
         // If keypress lights are enabled, illuminate the LED of the
         // currently activated keys, but only the bottom 12 keys.
@@ -791,15 +1054,7 @@ void Midifighter_Task(void)
         }
 
         // update the external key LEDs.
-        uint8_t key_leds = 0;
-        uint8_t key_bit = 0x1;
-        for (uint8_t i=0; i<4; ++i) {
-            if (g_midi_note_state[MIDI_DIGITAL_NOTE + i] > 0) {
-                key_leds |= key_bit;
-            }
-            key_bit <<= 1;
-        }
-        exp_set_key_led(key_leds);
+        exp_set_key_led(lit_notes(MIDI_DIGITAL_NOTE, blink) & 0x0f);
 
     } else if (g_key_fourbanks_mode == FOURBANKS_EXTERNAL) {
 
@@ -810,13 +1065,9 @@ void Midifighter_Task(void)
         uint8_t bank_led = 1 << g_key_bank_selected;
         exp_set_key_led(bank_led);
 
-        // set the LED on each key that has a non-zero MIDI state.
+        // set the LED on each key that has a lit MIDI state.
         uint8_t basenote = MIDI_BASE_NOTE + (g_key_bank_selected * 16);
-        for (uint8_t i=basenote; i<basenote + 16; ++i) {
-            if (g_midi_note_state[i] > 0) {
-                leds |= 1 << midi_fourbanks_note_to_key(i);
-            }
-        }
+        leds |= midi_note_bits_to_keys(lit_notes(basenote, blink));
 
         // If keypress lights are enabled, illuminate the LEDs of the
         // currently activated keys.
@@ -826,6 +1077,12 @@ void Midifighter_Task(void)
 
     } // fourbanks mode
 
+    // Draw the level meter over the top, if one is enabled.
+    leds = led_meter_overlay(leds);
+
+    // And the settings confirmation flash over everything.
+    leds = led_flash_overlay(leds);
+
     // Illuminate the LEDs with the new pattern.
     led_set_state(leds);
 
@@ -834,16 +1091,17 @@ void Midifighter_Task(void)
     // Use explicit values so we can tweak
     // the flashing pattern: one beat on, three beat off.
     //
-    // There are 24 clock ticks per beat, 96 per bar.
+    // There are 24 clock ticks per beat, 96 per bar. The position comes
+    // from the beat tracker, so USB jitter on the clock doesn't show up as
+    // flicker.
     //
-    if (g_led_groundfx_counter == 0) {
+    uint8_t beat_tick = bar_tick % MIDI_CLOCK_TICKS_PER_BEAT;
+    if (beat_tick == 0) {
         led_groundfx_state(true);
-    } else if (g_led_groundfx_counter < 8) {
+    } else if (beat_tick < 8) {
         led_groundfx_state(false);
-    } else if (g_led_groundfx_counter < 24) {
-        led_groundfx_state(true);
     } else {
-        g_led_groundfx_counter = 0;
+        led_groundfx_state(true);
     }
 	
 	// Set watchdog flag so main loop knows this section ran
@@ -905,6 +1163,9 @@ int main(void)
     // Start up the subsystems.
     eeprom_setup();   // setup global settings from the EEPROM
 	key_setup();  // startup the key debounce interrupt.
+    g_key_bank_selected = eeprom_journal_get(JOURNAL_BANK) & 0x03;
+    preset_setup();  // switch to the active preset
+    clock_setup();    // startup the free running timer for MIDI clock.
     spi_setup();  // startup the SPI bus.
     led_setup();  // startup the LED chip.
     exp_setup();  // startup the expansion ports and ADC.
@@ -975,6 +1236,7 @@ int main(void)
        // while(1);
 		
 		led_set_state(0xA5A5);
+		eeprom_flush();
 		Jump_To_Bootloader();
 
     }  else if(g_key_state == 0x0001) {
@@ -1028,14 +1290,19 @@ int main(void)
     // Enter an endless loop.
     for(;;) {
         // Read keys and expansion port to check for MIDI events to send and
-        // LEDs to set.
-        Midifighter_Task();
+        // LEDs to set, unless the LEDs are showing that USB just came up.
+        if (!usb_configured_task()) {
+            Midifighter_Task();
+        }
 
-        // Let the LUFA MIDI Device drivers have a go.
-        MIDI_Device_USBTask(g_midi_interface_info);
+        // Save any runtime state that has settled.
+        eeprom_journal_task();
 
-        // Update the USB state.
-        USB_USBTask();
+        // NOTE: MIDI_Device_USBTask() is not called, all it does is flush
+        // the IN endpoint and that waits on the host. Outgoing MIDI is sent
+        // by midi_flush() instead. USB_USBTask() isn't needed either, the
+        // library is built with INTERRUPT_CONTROL_ENDPOINT so control
+        // requests are serviced from the USB interrupt.
 		
 		// Reset the watch dog timer, dawg
 		if (main_watchdog_flag)
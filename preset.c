@@ -0,0 +1,136 @@
+// Preset slot functions for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "constants.h"
+#include "config.h"
+#include "eeprom.h"
+#include "preset.h"
+
+// Preset slots.
+//
+// Each slot holds the settings a DJ is likely to want their own copy of,
+// stored in EEPROM at EE_PRESETS one slot after another. Switching preset
+// reads the slot straight into the live settings, which the next key scan
+// picks up. The slots aren't kept in RAM, there's none to spare, and an
+// EEPROM read only waits if a write is being programmed.
+//
+// The live settings are always those of the active slot: whenever they are
+// saved (menu, config push) the active slot is saved too, and the active
+// slot number itself is kept in the runtime state journal.
+
+// Settings held in a slot, as config tags.
+static const uint8_t kPresetTags[PRESET_FIELDS] PROGMEM = {
+    0x00,  // MIDI channel
+    0x01,  // MIDI velocity
+    0x02,  // Keypress LEDs
+    0x03,  // Fourbanks mode
+    0x07,  // Device mode
+    0x08,  // Combos
+    0x0A,  // Rotate
+};
+
+// Globals ---------------------------------------------------------------------
+
+uint8_t g_preset_active;
+
+// Functions -------------------------------------------------------------------
+
+static uint16_t preset_address(const uint8_t preset, const uint8_t field)
+{
+    return EE_PRESETS + preset * PRESET_FIELDS + field;
+}
+
+// Switch the live settings to the active slot. A value the setting can't
+// take, from a slot that was never fully written, leaves the live setting
+// as it is, and the slot is repaired with it.
+//
+static void preset_apply(void)
+{
+    for (uint8_t f=0; f<PRESET_FIELDS; ++f) {
+        uint8_t tag = pgm_read_byte(&kPresetTags[f]);
+        uint16_t address = preset_address(g_preset_active, f);
+        if (!config_set_field(tag, eeprom_read(address))) {
+            eeprom_write(address, config_get_field(tag));
+        }
+    }
+}
+
+// Switch the live settings to the active slot. Call after eeprom_setup().
+//
+void preset_setup(void)
+{
+    uint8_t active = eeprom_journal_get(JOURNAL_PRESET);
+    g_preset_active = (active < PRESET_COUNT) ? active : 0;
+    preset_apply();
+}
+
+// Copy the live settings into the active slot, writing any that changed.
+//
+void preset_store(void)
+{
+    for (uint8_t f=0; f<PRESET_FIELDS; ++f) {
+        eeprom_update(preset_address(g_preset_active, f),
+                      config_get_field(pgm_read_byte(&kPresetTags[f])));
+    }
+}
+
+// Make another slot active. Any edits to the current slot are kept first.
+//
+void preset_select(const uint8_t preset)
+{
+    if (preset >= PRESET_COUNT || preset == g_preset_active) return;
+    preset_store();
+    g_preset_active = preset;
+    preset_apply();
+    eeprom_journal_set(JOURNAL_PRESET, preset);
+}
+
+// Fill every slot with the live settings, used by the factory reset.
+//
+void preset_reset(void)
+{
+    g_preset_active = 0;
+    for (uint8_t p=0; p<PRESET_COUNT; ++p) {
+        for (uint8_t f=0; f<PRESET_FIELDS; ++f) {
+            eeprom_write(preset_address(p, f),
+                         config_get_field(pgm_read_byte(&kPresetTags[f])));
+        }
+    }
+}
+
+// Can "value" be written to the EEPROM cell at "address"? Cells in a slot
+// have to hold a value their setting can take, anything else is not ours
+// to check.
+//
+bool preset_value_valid(const uint16_t address, const uint8_t value)
+{
+    uint16_t offset = address - EE_PRESETS;
+    if (address < EE_PRESETS || offset >= PRESET_COUNT * PRESET_FIELDS) {
+        return true;
+    }
+    uint8_t tag = pgm_read_byte(&kPresetTags[offset % PRESET_FIELDS]);
+    return config_field_valid(tag, value);
+}
+
+// -----------------------------------------------------------------------------
@@ -0,0 +1,49 @@
+// Preset slot functions for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+
+#ifndef _PRESET_H_INCLUDED
+#define _PRESET_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Constants ------------------------------------------------------------------
+
+#define PRESET_COUNT   4   // Number of preset slots.
+#define PRESET_FIELDS  7   // Settings held in each slot.
+
+// Key combination that selects a preset: hold both PRESET_COMBO_HOLD keys
+// and press one of the PRESET_COMBO_SELECT keys.
+#define PRESET_COMBO_HOLD    0x0009  // Top left and top right keys.
+#define PRESET_COMBO_SELECT  0xf000  // Bottom row, presets 1 to 4.
+
+// Globals --------------------------------------------------------------------
+
+extern uint8_t g_preset_active;  // Slot the live settings belong to.
+
+// Preset functions -----------------------------------------------------------
+
+void preset_setup(void);
+void preset_store(void);
+void preset_select(const uint8_t preset);
+void preset_reset(void);
+bool preset_value_valid(const uint16_t address, const uint8_t value);
+
+#endif // _PRESET_H_INCLUDED
@@ -1,41 +1,271 @@
+#include <string.h>
+
+#include <avr/pgmspace.h>
 
 #include "sysex.h"
 #include "constants.h"
 
 #include "midi.h"
 
-SysExFn sysExCommandMap[8] = {0,};
+SysExFn sysExCommandMap[SYSEX_MAX_COMMANDS] = {0,};
+
+// Scratch space for command handlers, only one message is parsed at a time.
+uint8_t g_sysex_scratch[SYSEX_SCRATCH_SIZE];
+
+// Universal Non Real Time Identity Reply, sent straight from program
+// memory.
+static const uint8_t kIdentityReply[] PROGMEM = {
+    0xf0, 0x7e, 0x7f, 0x06, 0x02,
+    0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+    DEVICE_FAMILY,
+    DEVICE_MODEL,
+    DEVICE_VERSION >> 24,
+    (DEVICE_VERSION >> 16) & 0x7f,
+    (DEVICE_VERSION >> 8) & 0x7f,
+    DEVICE_VERSION & 0x7f,
+    0xf7
+};
+
+// SysEx parser --------------------------------------------------
+//
+// Messages are checked a byte at a time as they arrive. The header is
+//
+//   F0 00 <id hi> <id lo> <command> <payload ...> F7
+//
+// and once the command is known its handler is given the payload a byte at
+// a time, so a message can be any length. Anything that isn't for us is
+// skipped over to the 0xF7. The only Universal message we answer is the
+// Identity Request, F0 7E <device> 06 01 F7.
 
-void sysex_handle (SysEx_t* sysex)
+#define PARSE_IDLE          0  // Waiting for 0xF0.
+#define PARSE_MANUFACTURER  1  // Checking our manufacturer ID and command.
+#define PARSE_UNIVERSAL     2  // Checking a Universal Non Real Time header.
+#define PARSE_PAYLOAD       3  // Handing payload bytes to s_parse_handler.
+#define PARSE_IDENTITY      4  // Identity Request, waiting for the 0xF7.
+#define PARSE_SKIP          5  // Not for us, waiting for the 0xF7.
+
+static uint8_t s_parse_state = PARSE_IDLE;
+static uint16_t s_parse_index;     // Header or payload byte count.
+static SysExFn s_parse_handler;    // Handler for the current command.
+
+// Feed one byte of SysEx to the parser. "cable" is the USB-MIDI virtual
+// cable it arrived on, replies go back on the same cable.
+//
+void sysex_receive (uint8_t byte, uint8_t cable)
 {
-    if (sysex->mid == 0x0 &&
-        sysex->mid_ex1 == (MANUFACTURER_ID >> 8) &&
-        sysex->mid_ex2 == (MANUFACTURER_ID & 0x7f)) {
-        // This message is meant for us.
+    if (byte == 0xf0) {
+        // A new message, abandoning any message in progress.
+        if (s_parse_state == PARSE_PAYLOAD) {
+            s_parse_handler(SYSEX_ABORT, s_parse_index, 0);
+        }
+        s_parse_state = PARSE_MANUFACTURER;
+        s_parse_index = 0;
+        return;
+    }
+
+    if (byte == 0xf7) {
+        // Any reply goes back on the cable the request came in on.
+        g_midi_sysex_cable = cable;
+        if (s_parse_state == PARSE_PAYLOAD) {
+            s_parse_handler(SYSEX_END, s_parse_index, 0);
+        } else if (s_parse_state == PARSE_IDENTITY) {
+            midi_stream_sysex_source(sizeof(kIdentityReply),
+                                     midi_source_progmem,
+                                     kIdentityReply);
+        }
+        g_midi_sysex_cable = MIDI_CABLE_CONFIG;
+        s_parse_state = PARSE_IDLE;
+        return;
+    }
 
-        if (sysExCommandMap[sysex->command]) {
-            sysExCommandMap[sysex->command](sysex, sysex->payload);
+    if (byte & 0x80) {
+        // No other status byte belongs in a SysEx message.
+        if (s_parse_state == PARSE_PAYLOAD) {
+            s_parse_handler(SYSEX_ABORT, s_parse_index, 0);
         }
+        s_parse_state = PARSE_IDLE;
+        return;
     }
-    else if (sysex->mid == 0x7e) { // Universal Non Real Time
-        if (sysex->mid_ex2 == 0x06 && sysex->command == 0x01) { // Device identify request
-            uint8_t payload[] = {0xf0, 0x7e, 0x7f, 0x06, 0x02,
-                                       0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
-                                       DEVICE_FAMILY,
-                                       DEVICE_MODEL,
-                                       DEVICE_VERSION >> 24,
-                                       (DEVICE_VERSION >> 16) & 0x7f,
-                                       (DEVICE_VERSION >> 8) & 0x7f,
-                                       DEVICE_VERSION & 0x7f,
-                                       0xf7};
-
-            midi_stream_sysex(17, payload);
+
+    uint16_t pos = s_parse_index++;
+    switch (s_parse_state) {
+    case PARSE_MANUFACTURER:
+        if (pos == 0) {
+            if (byte == 0x7e) {
+                s_parse_state = PARSE_UNIVERSAL;
+            } else if (byte != 0x00) {
+                s_parse_state = PARSE_SKIP;
+            }
+        } else if (pos == 1) {
+            if (byte != (MANUFACTURER_ID >> 8)) s_parse_state = PARSE_SKIP;
+        } else if (pos == 2) {
+            if (byte != (MANUFACTURER_ID & 0x7f)) s_parse_state = PARSE_SKIP;
+        } else {
+            // This message is meant for us.
+            s_parse_handler = (byte < SYSEX_MAX_COMMANDS) ?
+                              sysExCommandMap[byte] : 0;
+            if (s_parse_handler) {
+                s_parse_state = PARSE_PAYLOAD;
+                s_parse_index = 0;
+                s_parse_handler(SYSEX_BEGIN, 0, 0);
+            } else {
+                s_parse_state = PARSE_SKIP;
+            }
+        }
+        break;
+
+    case PARSE_UNIVERSAL:
+        // pos 1 is the device ID, which we accept whatever it is.
+        if (pos == 2 && byte != 0x06) {
+            s_parse_state = PARSE_SKIP;
+        } else if (pos == 3) {
+            s_parse_state = (byte == 0x01) ? PARSE_IDENTITY : PARSE_SKIP;
         }
+        break;
+
+    case PARSE_PAYLOAD:
+        s_parse_handler(SYSEX_DATA, pos, byte);
+        break;
+
+    case PARSE_IDENTITY:
+        // Trailing bytes on an Identity Request, not a valid request.
+        s_parse_state = PARSE_SKIP;
+        break;
+    }
+}
+
+// Helper for handlers that only need the start of the payload: keep each
+// payload byte in g_sysex_scratch while there's room. Returns true on
+// SYSEX_END, when the handler should act on what it has collected.
+//
+bool sysex_collect (uint8_t op, uint16_t index, uint8_t byte)
+{
+    if (op == SYSEX_DATA && index < SYSEX_SCRATCH_SIZE) {
+        g_sysex_scratch[index] = byte;
     }
+    return op == SYSEX_END;
 }
 
 
 void sysex_install_ (uint8_t cmd, SysExFn fn)
 {
-    sysExCommandMap[cmd] = fn;
+    if (cmd < SYSEX_MAX_COMMANDS) {
+        sysExCommandMap[cmd] = fn;
+    }
+}
+
+// Return a bit for each command that has a handler installed, bit 0 for
+// command 0.
+//
+uint16_t sysex_command_mask (void)
+{
+    uint16_t mask = 0;
+    for (uint8_t i=0; i<SYSEX_MAX_COMMANDS; ++i) {
+        if (sysExCommandMap[i]) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+
+// 8-to-7 bit packing ---------------------------------------------
+
+// Start decoding a new packed stream.
+//
+void sysex_unpack_begin (SysExUnpack_t* state)
+{
+    state->msbs = 0;
+    state->pos = 0;
+}
+
+// Feed one packed byte to the decoder. Returns true and sets "out" when a
+// data byte has been decoded, false when the byte was a group's top bits.
+//
+bool sysex_unpack_byte (SysExUnpack_t* state, uint8_t in, uint8_t* out)
+{
+    if (state->pos == 0) {
+        state->msbs = in;
+        state->pos = 1;
+        return false;
+    }
+    *out = (in & 0x7f) | ((state->msbs & 0x01) << 7);
+    state->msbs >>= 1;
+    if (++state->pos == 8) {
+        state->pos = 0;
+    }
+    return true;
+}
+
+// Everything sysex_packed_byte() needs to generate a packed message.
+typedef struct {
+    const uint8_t* header;    // Plain bytes to send after the 0xF0.
+    uint8_t header_length;
+    uint16_t length;          // Bytes of data to pack.
+    MidiByteSource source;    // Where the data comes from.
+    const void* context;
+} SysExPacked_t;
+
+// Byte source for a whole packed message: 0xF0, the plain header, the
+// packed data and the closing 0xF7. Each packed byte is worked out from
+// the data source on demand, so nothing is buffered.
+//
+static uint8_t sysex_packed_byte (const uint16_t index, const void* context)
+{
+    const SysExPacked_t* packed = (const SysExPacked_t*)context;
+    if (index == 0) {
+        return 0xf0;
+    }
+    uint16_t offset = index - 1;
+    if (offset < packed->header_length) {
+        return packed->header[offset];
+    }
+    offset -= packed->header_length;
+    if (offset >= SYSEX_PACKED_LENGTH(packed->length)) {
+        return 0xf7;
+    }
+
+    uint16_t group = (offset / 8) * 7;
+    uint8_t pos = offset % 8;
+    if (pos) {
+        return packed->source(group + pos - 1, packed->context) & 0x7f;
+    }
+    // Gather the top bits of the group.
+    uint8_t msbs = 0;
+    for (uint8_t i=0; i<7 && group + i < packed->length; ++i) {
+        if (packed->source(group + i, packed->context) & 0x80) {
+            msbs |= 1 << i;
+        }
+    }
+    return msbs;
+}
+
+// The packed message being sent. It's read as the host takes the message,
+// long after sysex_stream_packed() has returned, so the header is copied.
+static uint8_t s_packed_header[SYSEX_PACKED_HEADER_SIZE];
+static SysExPacked_t s_packed = {.header = s_packed_header};
+
+// Send a SysEx message made up of a plain 7-bit header (manufacturer ID,
+// command and any fields) followed by "length" bytes of binary data from
+// "source", packed 8-to-7 on the fly. The data is read as the message goes
+// out, so "context" must stay valid until midi_sysex_busy() returns false.
+//
+bool sysex_stream_packed (const uint8_t* header,
+                          uint8_t header_length,
+                          uint16_t length,
+                          MidiByteSource source,
+                          const void* context)
+{
+    if (midi_sysex_busy() || header_length > sizeof(s_packed_header)) {
+        return false;
+    }
+    memcpy(s_packed_header, header, header_length);
+    s_packed.header_length = header_length;
+    s_packed.length        = length;
+    s_packed.source        = source;
+    s_packed.context       = context;
+    return midi_stream_sysex_source(1 + header_length +
+                                    SYSEX_PACKED_LENGTH(length) + 1,
+                                    sysex_packed_byte,
+                                    &s_packed);
 }
@@ -24,44 +24,82 @@
 #define _SYSEX_H_INCLUDED
 
 #include <stdint.h>
-
-#define STR_COMBINE(a,b) a##b
-#define SYSEX_READ(n) if (index < SYSEX_MAX_PAYLOAD) {sysEx.data[index++] = STR_COMBINE(input_event.Data,n);} else {index = 0; continue;} do {} while (0)
-#define SYSEX_END() sysEx.length = index; sysex_handle (&sysEx); index = 0
+#include <stdbool.h>
+#include "midi.h"
 
 // SysEx constants -----------------------------------------------
 
-#define SYSEX_MAX_PAYLOAD 32
+// Version of the SysEx command protocol. Bump this whenever a command is
+// added or an existing message changes, host tools read it back with the
+// capabilities command.
+#define SYSEX_PROTOCOL_VERSION 4
+
+// Number of command slots in the registry. Commands are numbered from zero
+// and anything past the last slot is ignored. config_setup() installs
+// commands 0x01 to 0x0A, so that's all the slots there are.
+#define SYSEX_MAX_COMMANDS 11
+
+// Size of the scratch buffer shared by the command handlers. It also holds
+// SysEx sent from RAM while it's written, which is why the longer replies
+// are generated from byte sources instead.
+#define SYSEX_SCRATCH_SIZE 28
+
+// Operations passed to a command handler.
+#define SYSEX_BEGIN  0  // A message for this command has started.
+#define SYSEX_DATA   1  // One payload byte, "index" counts from zero.
+#define SYSEX_END    2  // The 0xF7 arrived, "index" is the payload length.
+#define SYSEX_ABORT  3  // The message was cut short by a new 0xF0.
 
 // SysEx types     -----------------------------------------------
 
-// SysEx message structure
+// SysEx command handler function. Messages are parsed a byte at a time as
+// they arrive, nothing is buffered, so a handler sees its payload as a
+// stream of SYSEX_DATA calls between SYSEX_BEGIN and SYSEX_END (or
+// SYSEX_ABORT). Handlers that only need a few bytes can keep them in
+// g_sysex_scratch with sysex_collect().
+typedef void (*SysExFn)(uint8_t op, uint16_t index, uint8_t byte);
+
+// SysEx globals   -----------------------------------------------
+
+extern uint8_t g_sysex_scratch[SYSEX_SCRATCH_SIZE];
+
+// 8-to-7 bit packing ---------------------------------------------
+//
+// Binary data is sent in groups of up to seven bytes, each group preceded
+// by a byte holding the top bits of the group, bit 0 for the first byte,
+// bit 1 for the second and so on:
+//
+//    0 h6 h5 h4 h3 h2 h1 h0 | 0 d0 | 0 d1 | 0 d2 | ... | 0 d6
+//
+// which costs one extra byte in eight, rather than one in two for
+// tag/value pairs.
+
+// Longest plain header a packed message can have.
+#define SYSEX_PACKED_HEADER_SIZE 10
+
+// Number of bytes "length" bytes of data take up once packed.
+#define SYSEX_PACKED_LENGTH(length) ((length) + ((length) + 6) / 7)
+
+// Streaming decoder state.
 typedef struct {
-    union {
-        struct {
-            // SysEx header
-            uint8_t header;
-            // Manufacturer id
-            uint8_t mid;
-            uint8_t mid_ex1;
-            uint8_t mid_ex2;
-            // Command
-            uint8_t command;
-            // Message payload
-            uint8_t payload[SYSEX_MAX_PAYLOAD];
-        };
-        uint8_t data[SYSEX_MAX_PAYLOAD + 5];
-    };
-    uint8_t length;
-} SysEx_t;
-
-// SysEx command handler function
-typedef void (*SysExFn)(SysEx_t*, void*);
+    uint8_t msbs;  // Top bits for the rest of the current group.
+    uint8_t pos;   // Position in the current group (0 = top bits next).
+} SysExUnpack_t;
 
 // SysEx functions -----------------------------------------------
 
 #define sysex_install(cmd,fn) sysex_install_(cmd, (SysExFn)fn)
 void sysex_install_ (uint8_t cmd, SysExFn fn);
-void sysex_handle (SysEx_t* sysex);
+uint16_t sysex_command_mask (void);
+void sysex_receive (uint8_t byte, uint8_t cable);
+bool sysex_collect (uint8_t op, uint16_t index, uint8_t byte);
+
+void sysex_unpack_begin (SysExUnpack_t* state);
+bool sysex_unpack_byte (SysExUnpack_t* state, uint8_t in, uint8_t* out);
+bool sysex_stream_packed (const uint8_t* header,
+                          uint8_t header_length,
+                          uint16_t length,
+                          MidiByteSource source,
+                          const void* context);
 
 #endif // _SYSEX_H_INCLUDED
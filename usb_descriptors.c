@@ -212,6 +212,50 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor = {
         .JackStrIndex             = NO_DESCRIPTOR
     },
 
+    // The second set of jacks carries virtual cable 1, the configuration
+    // port.
+    .MIDI_In_Jack_Emb_Config = {
+        .Header                   = { .Size = sizeof(USB_MIDI_Descriptor_InputJack_t),
+                                      .Type = DTYPE_CSInterface },
+        .Subtype                  = AUDIO_DSUBTYPE_CSInterface_InputTerminal,
+        .JackType                 = MIDI_JACKTYPE_Embedded,
+        .JackID                   = 0x05,
+        .JackStrIndex             = 0x04
+    },
+
+    .MIDI_In_Jack_Ext_Config = {
+        .Header                   = { .Size = sizeof(USB_MIDI_Descriptor_InputJack_t),
+                                      .Type = DTYPE_CSInterface },
+        .Subtype                  = AUDIO_DSUBTYPE_CSInterface_InputTerminal,
+        .JackType                 = MIDI_JACKTYPE_External,
+        .JackID                   = 0x06,
+        .JackStrIndex             = NO_DESCRIPTOR
+    },
+
+    .MIDI_Out_Jack_Emb_Config = {
+        .Header                   = { .Size = sizeof(USB_MIDI_Descriptor_OutputJack_t),
+                                      .Type = DTYPE_CSInterface },
+        .Subtype                  = AUDIO_DSUBTYPE_CSInterface_OutputTerminal,
+        .JackType                 = MIDI_JACKTYPE_Embedded,
+        .JackID                   = 0x07,
+        .NumberOfPins             = 1,
+        .SourceJackID             = {0x06},
+        .SourcePinID              = {0x01},
+        .JackStrIndex             = 0x04
+    },
+
+    .MIDI_Out_Jack_Ext_Config = {
+        .Header                   = { .Size = sizeof(USB_MIDI_Descriptor_OutputJack_t),
+                                      .Type = DTYPE_CSInterface },
+        .Subtype                  = AUDIO_DSUBTYPE_CSInterface_OutputTerminal,
+        .JackType                 = MIDI_JACKTYPE_External,
+        .JackID                   = 0x08,
+        .NumberOfPins             = 1,
+        .SourceJackID             = {0x05},
+        .SourcePinID              = {0x01},
+        .JackStrIndex             = NO_DESCRIPTOR
+    },
+
     .MIDI_In_Jack_Endpoint = {
         .Endpoint = {
             .Header              = { .Size = sizeof(USB_Audio_Descriptor_StreamEndpoint_Std_t),
@@ -226,11 +270,11 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor = {
         },
 
     .MIDI_In_Jack_Endpoint_SPC = {
-        .Header                   = { .Size = sizeof(USB_MIDI_Descriptor_Jack_Endpoint_t),
+        .Header                   = { .Size = sizeof(USB_MIDI_Descriptor_Jack_Endpoint_Pair_t),
                                       .Type = DTYPE_CSEndpoint },
         .Subtype                  = AUDIO_DSUBTYPE_CSEndpoint_General,
-        .TotalEmbeddedJacks       = 0x01,
-        .AssociatedJackID         = {0x01}
+        .TotalEmbeddedJacks       = 0x02,
+        .AssociatedJackID         = {0x01, 0x05}  // cable 0, cable 1
     },
 
     .MIDI_Out_Jack_Endpoint = {
@@ -247,11 +291,11 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor = {
     },
 
     .MIDI_Out_Jack_Endpoint_SPC = {
-        .Header                   = { .Size = sizeof(USB_MIDI_Descriptor_Jack_Endpoint_t),
+        .Header                   = { .Size = sizeof(USB_MIDI_Descriptor_Jack_Endpoint_Pair_t),
                                       .Type = DTYPE_CSEndpoint },
         .Subtype                  = AUDIO_DSUBTYPE_CSEndpoint_General,
-        .TotalEmbeddedJacks       = 0x01,
-        .AssociatedJackID         = {0x03}
+        .TotalEmbeddedJacks       = 0x02,
+        .AssociatedJackID         = {0x03, 0x07}  // cable 0, cable 1
     }
 };
 
@@ -309,6 +353,17 @@ const USB_Descriptor_String_t PROGMEM ProductString =
 #endif
 };
 
+// Jack descriptor string, naming the configuration port on hosts that show
+// it. The performance port is left unnamed, so it keeps the name existing
+// DJ software mappings are bound to.
+//
+const USB_Descriptor_String_t PROGMEM ConfigJackString =
+{
+    .Header                 = { .Size = USB_STRING_LEN(6),
+                                .Type = DTYPE_String },
+    .UnicodeString          = L"Config"
+};
+
 // This function is called by the library when in device mode, and must be
 // overridden (see library "USB Descriptors" documentation) by the
 // application code so that the address and size of a requested descriptor
@@ -349,6 +404,10 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
             Address = &ProductString;
             Size    = pgm_read_byte(&ProductString.Header.Size);
             break;
+        case 0x04:
+            Address = &ConfigJackString;
+            Size    = pgm_read_byte(&ConfigJackString.Header.Size);
+            break;
         }
         break;
     }
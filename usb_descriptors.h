@@ -42,13 +42,33 @@
 // Midifighter)
 #define MIDI_STREAM_IN_EPNUM 2
 
-// The size of a USB endpoint, 64 bytes, which will fit 16 normal USB-MIDI
-// packets.
-#define MIDI_STREAM_EPSIZE 64
+// The size of a USB endpoint bank, 32 bytes, which will fit 8 normal
+// USB-MIDI packets. Both MIDI endpoints are double banked so the host can
+// be working on one bank while we fill or empty the other. Two banks of 64
+// bytes on each endpoint would not fit in the AT90USB162's 176 bytes of
+// endpoint memory.
+#define MIDI_STREAM_EPSIZE 32
+
+
+// Virtual cables. Each one appears to the host as a separate MIDI port, so
+// the host can ignore configuration traffic during a performance and long
+// SysEx replies never hold up notes.
+#define MIDI_CABLE_PERFORMANCE 0  // Keys, analog controls, LED feedback, clock.
+#define MIDI_CABLE_CONFIG      1  // Configuration and diagnostic SysEx.
 
 
 // USB Descriptor -------------------------------------------------------------
 
+// LUFA's jack endpoint descriptor only has room for one embedded jack.
+// Both of ours carry two, one for each virtual cable.
+//
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint8_t                 Subtype;
+    uint8_t                 TotalEmbeddedJacks;
+    uint8_t                 AssociatedJackID[2];
+} ATTR_PACKED USB_MIDI_Descriptor_Jack_Endpoint_Pair_t;
+
 // Type for the device configuration descriptor structure.
 //
 // This must be defined in the application code as this configuration
@@ -65,10 +85,14 @@ typedef struct {
     USB_MIDI_Descriptor_InputJack_t           MIDI_In_Jack_Ext;
     USB_MIDI_Descriptor_OutputJack_t          MIDI_Out_Jack_Emb;
     USB_MIDI_Descriptor_OutputJack_t          MIDI_Out_Jack_Ext;
+    USB_MIDI_Descriptor_InputJack_t           MIDI_In_Jack_Emb_Config;
+    USB_MIDI_Descriptor_InputJack_t           MIDI_In_Jack_Ext_Config;
+    USB_MIDI_Descriptor_OutputJack_t          MIDI_Out_Jack_Emb_Config;
+    USB_MIDI_Descriptor_OutputJack_t          MIDI_Out_Jack_Ext_Config;
     USB_Audio_Descriptor_StreamEndpoint_Std_t MIDI_In_Jack_Endpoint;
-    USB_MIDI_Descriptor_Jack_Endpoint_t       MIDI_In_Jack_Endpoint_SPC;
+    USB_MIDI_Descriptor_Jack_Endpoint_Pair_t  MIDI_In_Jack_Endpoint_SPC;
     USB_Audio_Descriptor_StreamEndpoint_Std_t MIDI_Out_Jack_Endpoint;
-    USB_MIDI_Descriptor_Jack_Endpoint_t       MIDI_Out_Jack_Endpoint_SPC;
+    USB_MIDI_Descriptor_Jack_Endpoint_Pair_t  MIDI_Out_Jack_Endpoint_SPC;
 } USB_Descriptor_Configuration_t;
 
 